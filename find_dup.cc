@@ -1,5 +1,9 @@
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <new>
 #include <iostream>
 #include <sstream>
 #include <stdio.h>
@@ -12,6 +16,7 @@
 #include "skiplist.h"
 #include "mempool.h"
 #include "node.h"
+#include "xlist.h"
 
 unsigned long long total_alloc = 0;
 struct timeval last_tv = { 0, 0 };
@@ -61,14 +66,51 @@ struct HashPoolAlloc {
 };
 MemPool<HashElt> HashPoolAlloc::pool;
 
+// digests written by xmd5 -H, md5 ones are not tagged
+struct HashAlgo {
+	const char *tag;
+	size_t size;
+	const char *empty_digest;
+};
+
+static const HashAlgo hash_algos[] = {
+	{ "", 16, "d41d8cd98f00b204e9800998ecf8427e" },
+	{ "xxh128:", 16, "xxh128:99aa06d3014798d86001c324468d497f" },
+	{ NULL, 0, NULL }
+};
+
+// index in hash_algos of a valid digest, -1 if it is not one
+static int get_hash_algo(const char *digest_str)
+{
+	for (int i = 0; hash_algos[i].tag; ++i) {
+		size_t tag_len = strlen(hash_algos[i].tag);
+		if (strncmp(digest_str, hash_algos[i].tag, tag_len) != 0) continue;
+		const char *p = digest_str + tag_len;
+		while ((*p >= '0' && *p <= '9') ||
+		       (*p >= 'a' && *p <= 'f') ||
+		       (*p >= 'A' && *p <= 'F')) ++p;
+		if (*p == '\0' &&
+		    static_cast<size_t>(p - digest_str) == tag_len + 2 * hash_algos[i].size) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// all the digests are 16 bytes, those of each algorithm go in their own list
 struct HashElt : public HashPoolAlloc {
 	static const size_t HASH_SIZE = 16;
 
 	Node *node;
 	unsigned char hash[HASH_SIZE];
 
-	HashElt(Node *n, const char *md5_str) : node(n) {
-		set_hash(md5_str);
+	HashElt(Node *n, int a, const char *digest_str) : node(n) {
+		set_hash(digest_str + strlen(hash_algos[a].tag));
+		node->group = node;
+	}
+
+	HashElt(Node *n, const unsigned char *digest) : node(n) {
+		memcpy(hash, digest, HASH_SIZE);
 		node->group = node;
 	}
 
@@ -108,7 +150,8 @@ struct HashElt : public HashPoolAlloc {
 	}
 };
 
-SkipList<HashElt> hash_skip_list;
+static const int HASH_ALGO_COUNT = sizeof (hash_algos) / sizeof (hash_algos[0]) - 1;
+SkipList<HashElt> hash_skip_lists[HASH_ALGO_COUNT];
 
 static std::string to_human_str(unsigned long long v)
 {
@@ -137,6 +180,22 @@ static std::string to_human_str(unsigned long long v)
 	return "?";
 }
 
+// archive members carry the inode of the archive, it goes to the vnode of
+// the archive, the outermost one for nested archives
+static void set_node_inode(Node *node, const char *path,
+                           unsigned long long dev, unsigned long long ino)
+{
+	if (strstr(path, "%%%%/")) {
+		Node *archive = NULL;
+		for (Node *p = node; p; p = p->parent) {
+			if (p->vnode) archive = p;
+		}
+		if (!archive) return;
+		node = archive;
+	}
+	node->set_inode(dev, ino);
+}
+
 void read_line(Node *root_node, char *line,
                const char *filename, size_t line_nb)
 {
@@ -148,6 +207,7 @@ void read_line(Node *root_node, char *line,
 	try {
 		char *b_md5 = NULL;
 		char *b_size = NULL;
+		char *b_inode = NULL;
 		char *b_path = NULL;
 
 		for (size_t j = 0; j < option_format.length(); ++j) {
@@ -163,6 +223,9 @@ void read_line(Node *root_node, char *line,
 			case 's':
 				b_size = p;
 				break;
+			case 'i':
+				b_inode = p;
+				break;
 			}
 			p = p2 + 1;
 			while (*p == ' ' || *p == '\t') ++p;
@@ -175,18 +238,17 @@ void read_line(Node *root_node, char *line,
 			if (*p != '\0') size = 0;
 		}
 
+		int algo = b_md5 ? get_hash_algo(b_md5) : -1;
 		if (option_zero || size != 0 ||
-		    (b_md5 && strcmp(b_md5, "d41d8cd98f00b204e9800998ecf8427e") != 0)) {
+		    (b_md5 && (algo < 0 || strcmp(b_md5, hash_algos[algo].empty_digest) != 0))) {
 			Node *node = root_node->insert_node(b_path, size);
-			if (b_md5 && !node->group) {
-				p = b_md5;
-				while ((*p >= '0' && *p <= '9') ||
-				       (*p >= 'a' && *p <= 'f') ||
-				       (*p >= 'A' && *p <= 'F')) ++p;
-				if (*p == '\0' && p - b_md5 == 32) {
-					HashElt hash_elt(node, b_md5);
-					hash_skip_list.insert(hash_elt);
-				}
+			if (b_inode) {
+				unsigned long long dev = strtoull(b_inode, &p, 10);
+				if (*p == ':') set_node_inode(node, b_path, dev, strtoull(p + 1, &p, 10));
+			}
+			if (algo >= 0 && !node->group) {
+				HashElt hash_elt(node, algo, b_md5);
+				hash_skip_lists[algo].insert(hash_elt);
 			}
 		}
 	} catch (const char *s) {
@@ -194,6 +256,55 @@ void read_line(Node *root_node, char *line,
 	}
 }
 
+static bool is_empty_digest(int algo, const unsigned char *digest)
+{
+	const char *empty = hash_algos[algo].empty_digest + strlen(hash_algos[algo].tag);
+	char hex[3];
+
+	for (size_t i = 0; i < hash_algos[algo].size; ++i) {
+		sprintf(hex, "%02x", digest[i]);
+		if (memcmp(hex, empty + 2 * i, 2) != 0) return false;
+	}
+	return true;
+}
+
+// listing written by xmd5 -B, after the first pre_len bytes of the magic
+void read_bin_file(Node *root_node, FILE *stream, const char *filename,
+                   const char *pre, size_t pre_len)
+{
+	xlist list;
+	xlist_entry e;
+	int ret;
+
+	if (xlist_read_open(&list, stream, pre, pre_len) != 0) {
+		std::cout << filename << ": bad header" << std::endl;
+		xlist_close(&list);
+		return;
+	}
+	int algo = -1;
+	for (int i = 0; hash_algos[i].tag; ++i) {
+		if (strcmp(list.tag, hash_algos[i].tag) == 0 &&
+		    list.digest_length == hash_algos[i].size) algo = i;
+	}
+	while ((ret = xlist_read(&list, &e)) > 0) {
+		unsigned long long size = (e.flags & XLIST_SIZE) ? e.size : 0;
+		bool hashed = (e.flags & XLIST_HASH) && algo >= 0;
+		if (option_zero || size != 0 || !hashed || !is_empty_digest(algo, e.digest)) {
+			char *path = xlist_escape_path(e.path, e.path_len);
+			if (!path) throw std::bad_alloc();
+			Node *node = root_node->insert_node(path, size);
+			if (e.flags & XLIST_INODE) set_node_inode(node, path, e.dev, e.ino);
+			if (hashed && !node->group) {
+				HashElt hash_elt(node, e.digest);
+				hash_skip_lists[algo].insert(hash_elt);
+			}
+			free(path);
+		}
+	}
+	if (ret < 0) std::cout << filename << ": truncated listing" << std::endl;
+	xlist_close(&list);
+}
+
 void read_file(Node *root_node, FILE *stream, const char *filename)
 {
 	size_t line_nb = 1;
@@ -201,9 +312,18 @@ void read_file(Node *root_node, FILE *stream, const char *filename)
 	char *read_buf = (char *)malloc(read_buf_size);
 	char *read_p = read_buf;
 	char *next_p = read_p;
+	size_t pre_len = fread(read_buf, 1, strlen(XLIST_MAGIC), stream);
+
+	if (pre_len == strlen(XLIST_MAGIC) && memcmp(read_buf, XLIST_MAGIC, pre_len) == 0) {
+		read_bin_file(root_node, stream, filename, read_buf, pre_len);
+		free(read_buf);
+		return;
+	}
 
 	do {
-		size_t sz = fread(next_p, 1, read_buf_size - (next_p - read_buf) - 1, stream);
+		size_t sz = pre_len;
+		pre_len = 0;
+		sz += fread(next_p + sz, 1, read_buf_size - (next_p + sz - read_buf) - 1, stream);
 		while (sz > 0) {
 			while (sz > 0 && *next_p != '\n' && *next_p != '\r') {
 				--sz;
@@ -258,6 +378,12 @@ int delete_list_cmp(const void *a, const void *b)
 	return 0;
 }
 
+static bool delete_size_greater(const std::pair<unsigned long long, size_t> &a,
+                                const std::pair<unsigned long long, size_t> &b)
+{
+	return b.first < a.first;
+}
+
 int main(int argc, char* argv[])
 {
 	int opt;
@@ -284,7 +410,7 @@ int main(int argc, char* argv[])
 			break;
 		case 'h':
 		default:
-			std::cerr << "Usage: " << argv[0] << " [-ectz] [-f (5s)] file" << std::endl;
+			std::cerr << "Usage: " << argv[0] << " [-ectz] [-f (5s|5si)] file" << std::endl;
 			exit(EXIT_FAILURE);
 		}
 	}
@@ -306,7 +432,7 @@ int main(int argc, char* argv[])
 	} else {
 		read_file(root_node, stdin, "stdin");
 	}
-	hash_skip_list.clear();
+	for (int i = 0; i < HASH_ALGO_COUNT; ++i) hash_skip_lists[i].clear();
 
 	std::cout << "breaking cycles / " << get_current_time() << std::endl;
 	root_node->break_sibling_cycles();
@@ -382,16 +508,28 @@ int main(int argc, char* argv[])
 	root_node->count_list_delete(delete_list);
 	std::cout << "sorting deletes / " << get_current_time() << std::endl;
 	qsort(delete_list, delete_list_count, sizeof (*delete_list), delete_list_cmp);
+	// hardlinks of kept files, or of files deleted before, free nothing
+	Node::InodeSet inodes;
+	bool linked = Node::has_inodes();
+	if (linked) root_node->kept_inodes(inodes);
+	std::vector<std::pair<unsigned long long, size_t> > delete_sizes(delete_list_count);
+	for (size_t i = 0; i < delete_list_count; ++i) {
+		delete_sizes[i].first = delete_list[i]->size;
+		if (linked) delete_sizes[i].first -= delete_list[i]->linked_size(inodes);
+		delete_sizes[i].second = i;
+	}
+	std::stable_sort(delete_sizes.begin(), delete_sizes.end(), delete_size_greater);
 	std::cout << "done / " << get_current_time() << std::endl;
 	unsigned long long prev_size = 0;
 	for (size_t i = 0; i < delete_list_count; ++i) {
-		if (i == 0 || delete_list[i]->size != prev_size) {
+		unsigned long long size = delete_sizes[i].first;
+		if (i == 0 || size != prev_size) {
 			if (i != 0) std::cout << std::endl;
-			std::cout << "delete size : " << delete_list[i]->size <<
-				" (" << to_human_str(delete_list[i]->size) << ")" << std::endl;
-			prev_size = delete_list[i]->size;
+			std::cout << "delete size : " << size <<
+				" (" << to_human_str(size) << ")" << std::endl;
+			prev_size = size;
 		}
-		std::cout << delete_list[i]->get_path() << std::endl;
+		std::cout << delete_list[delete_sizes[i].second]->get_path() << std::endl;
 	}
 	if (delete_list_count != 0) std::cout << std::endl;
 	delete[] delete_list;
@@ -0,0 +1,427 @@
+#include <string.h>
+
+#include "md5mb.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MD5MB_X86
+#include <immintrin.h>
+#endif
+
+/* a stream hashed by a kernel, from p for blocks blocks then tail bytes */
+struct md5mb_lane {
+	struct md5mb_stream *s;
+	const unsigned char *p;
+	size_t blocks;
+	size_t tail;
+};
+
+/* the 64 steps of the compression of a block, with the operations of the
+ * kernel: a = b + rol(a + f(b, c, d) + m + t, s) */
+#define MD5_ROUNDS \
+	STEP(F, a, b, c, d, m[ 0], 0xd76aa478,  7) \
+	STEP(F, d, a, b, c, m[ 1], 0xe8c7b756, 12) \
+	STEP(F, c, d, a, b, m[ 2], 0x242070db, 17) \
+	STEP(F, b, c, d, a, m[ 3], 0xc1bdceee, 22) \
+	STEP(F, a, b, c, d, m[ 4], 0xf57c0faf,  7) \
+	STEP(F, d, a, b, c, m[ 5], 0x4787c62a, 12) \
+	STEP(F, c, d, a, b, m[ 6], 0xa8304613, 17) \
+	STEP(F, b, c, d, a, m[ 7], 0xfd469501, 22) \
+	STEP(F, a, b, c, d, m[ 8], 0x698098d8,  7) \
+	STEP(F, d, a, b, c, m[ 9], 0x8b44f7af, 12) \
+	STEP(F, c, d, a, b, m[10], 0xffff5bb1, 17) \
+	STEP(F, b, c, d, a, m[11], 0x895cd7be, 22) \
+	STEP(F, a, b, c, d, m[12], 0x6b901122,  7) \
+	STEP(F, d, a, b, c, m[13], 0xfd987193, 12) \
+	STEP(F, c, d, a, b, m[14], 0xa679438e, 17) \
+	STEP(F, b, c, d, a, m[15], 0x49b40821, 22) \
+	STEP(G, a, b, c, d, m[ 1], 0xf61e2562,  5) \
+	STEP(G, d, a, b, c, m[ 6], 0xc040b340,  9) \
+	STEP(G, c, d, a, b, m[11], 0x265e5a51, 14) \
+	STEP(G, b, c, d, a, m[ 0], 0xe9b6c7aa, 20) \
+	STEP(G, a, b, c, d, m[ 5], 0xd62f105d,  5) \
+	STEP(G, d, a, b, c, m[10], 0x02441453,  9) \
+	STEP(G, c, d, a, b, m[15], 0xd8a1e681, 14) \
+	STEP(G, b, c, d, a, m[ 4], 0xe7d3fbc8, 20) \
+	STEP(G, a, b, c, d, m[ 9], 0x21e1cde6,  5) \
+	STEP(G, d, a, b, c, m[14], 0xc33707d6,  9) \
+	STEP(G, c, d, a, b, m[ 3], 0xf4d50d87, 14) \
+	STEP(G, b, c, d, a, m[ 8], 0x455a14ed, 20) \
+	STEP(G, a, b, c, d, m[13], 0xa9e3e905,  5) \
+	STEP(G, d, a, b, c, m[ 2], 0xfcefa3f8,  9) \
+	STEP(G, c, d, a, b, m[ 7], 0x676f02d9, 14) \
+	STEP(G, b, c, d, a, m[12], 0x8d2a4c8a, 20) \
+	STEP(H, a, b, c, d, m[ 5], 0xfffa3942,  4) \
+	STEP(H, d, a, b, c, m[ 8], 0x8771f681, 11) \
+	STEP(H, c, d, a, b, m[11], 0x6d9d6122, 16) \
+	STEP(H, b, c, d, a, m[14], 0xfde5380c, 23) \
+	STEP(H, a, b, c, d, m[ 1], 0xa4beea44,  4) \
+	STEP(H, d, a, b, c, m[ 4], 0x4bdecfa9, 11) \
+	STEP(H, c, d, a, b, m[ 7], 0xf6bb4b60, 16) \
+	STEP(H, b, c, d, a, m[10], 0xbebfbc70, 23) \
+	STEP(H, a, b, c, d, m[13], 0x289b7ec6,  4) \
+	STEP(H, d, a, b, c, m[ 0], 0xeaa127fa, 11) \
+	STEP(H, c, d, a, b, m[ 3], 0xd4ef3085, 16) \
+	STEP(H, b, c, d, a, m[ 6], 0x04881d05, 23) \
+	STEP(H, a, b, c, d, m[ 9], 0xd9d4d039,  4) \
+	STEP(H, d, a, b, c, m[12], 0xe6db99e5, 11) \
+	STEP(H, c, d, a, b, m[15], 0x1fa27cf8, 16) \
+	STEP(H, b, c, d, a, m[ 2], 0xc4ac5665, 23) \
+	STEP(I, a, b, c, d, m[ 0], 0xf4292244,  6) \
+	STEP(I, d, a, b, c, m[ 7], 0x432aff97, 10) \
+	STEP(I, c, d, a, b, m[14], 0xab9423a7, 15) \
+	STEP(I, b, c, d, a, m[ 5], 0xfc93a039, 21) \
+	STEP(I, a, b, c, d, m[12], 0x655b59c3,  6) \
+	STEP(I, d, a, b, c, m[ 3], 0x8f0ccc92, 10) \
+	STEP(I, c, d, a, b, m[10], 0xffeff47d, 15) \
+	STEP(I, b, c, d, a, m[ 1], 0x85845dd1, 21) \
+	STEP(I, a, b, c, d, m[ 8], 0x6fa87e4f,  6) \
+	STEP(I, d, a, b, c, m[15], 0xfe2ce6e0, 10) \
+	STEP(I, c, d, a, b, m[ 6], 0xa3014314, 15) \
+	STEP(I, b, c, d, a, m[13], 0x4e0811a1, 21) \
+	STEP(I, a, b, c, d, m[ 4], 0xf7537e82,  6) \
+	STEP(I, d, a, b, c, m[11], 0xbd3af235, 10) \
+	STEP(I, c, d, a, b, m[ 2], 0x2ad7d2bb, 15) \
+	STEP(I, b, c, d, a, m[ 9], 0xeb86d391, 21)
+
+#define STEP(f, a, b, c, d, x, t, s) \
+	a = ADD(a, ADD(ADD(f(b, c, d), x), SET1(t))); \
+	a = ADD(ROL(a, s), b);
+
+#define ADD(x, y) ((x) + (y))
+#define SET1(t) ((uint32_t)(t))
+#define ROL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+static void md5_blocks(uint32_t *h, const unsigned char *p, size_t blocks)
+{
+	uint32_t m[16];
+	uint32_t a, b, c, d;
+
+	for (; blocks > 0; --blocks, p += 64) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		memcpy(m, p, 64);
+#else
+		unsigned i;
+
+		for (i = 0; i < 16; ++i) {
+			m[i] = (uint32_t)p[i * 4] | (uint32_t)p[i * 4 + 1] << 8 |
+			       (uint32_t)p[i * 4 + 2] << 16 | (uint32_t)p[i * 4 + 3] << 24;
+		}
+#endif
+		a = h[0];
+		b = h[1];
+		c = h[2];
+		d = h[3];
+		MD5_ROUNDS
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+	}
+}
+
+#undef ADD
+#undef SET1
+#undef ROL
+#undef F
+#undef G
+#undef H
+#undef I
+
+#ifdef MD5MB_X86
+/* words w0 to w0 + 7 of the blocks of 8 lanes, word w of the lanes in m[w] */
+__attribute__((target("avx2")))
+static inline void md5_transpose8(__m256i *m, const unsigned char *const *p, unsigned w0)
+{
+	__m256i t0, t1, t2, t3, t4, t5, t6, t7;
+	__m256i u0, u1, u2, u3, u4, u5, u6, u7;
+
+	t0 = _mm256_loadu_si256((const __m256i *)(p[0] + w0 * 4));
+	t1 = _mm256_loadu_si256((const __m256i *)(p[1] + w0 * 4));
+	t2 = _mm256_loadu_si256((const __m256i *)(p[2] + w0 * 4));
+	t3 = _mm256_loadu_si256((const __m256i *)(p[3] + w0 * 4));
+	t4 = _mm256_loadu_si256((const __m256i *)(p[4] + w0 * 4));
+	t5 = _mm256_loadu_si256((const __m256i *)(p[5] + w0 * 4));
+	t6 = _mm256_loadu_si256((const __m256i *)(p[6] + w0 * 4));
+	t7 = _mm256_loadu_si256((const __m256i *)(p[7] + w0 * 4));
+	u0 = _mm256_unpacklo_epi32(t0, t1);
+	u1 = _mm256_unpackhi_epi32(t0, t1);
+	u2 = _mm256_unpacklo_epi32(t2, t3);
+	u3 = _mm256_unpackhi_epi32(t2, t3);
+	u4 = _mm256_unpacklo_epi32(t4, t5);
+	u5 = _mm256_unpackhi_epi32(t4, t5);
+	u6 = _mm256_unpacklo_epi32(t6, t7);
+	u7 = _mm256_unpackhi_epi32(t6, t7);
+	t0 = _mm256_unpacklo_epi64(u0, u2);
+	t1 = _mm256_unpackhi_epi64(u0, u2);
+	t2 = _mm256_unpacklo_epi64(u1, u3);
+	t3 = _mm256_unpackhi_epi64(u1, u3);
+	t4 = _mm256_unpacklo_epi64(u4, u6);
+	t5 = _mm256_unpackhi_epi64(u4, u6);
+	t6 = _mm256_unpacklo_epi64(u5, u7);
+	t7 = _mm256_unpackhi_epi64(u5, u7);
+	m[w0] = _mm256_permute2x128_si256(t0, t4, 0x20);
+	m[w0 + 1] = _mm256_permute2x128_si256(t1, t5, 0x20);
+	m[w0 + 2] = _mm256_permute2x128_si256(t2, t6, 0x20);
+	m[w0 + 3] = _mm256_permute2x128_si256(t3, t7, 0x20);
+	m[w0 + 4] = _mm256_permute2x128_si256(t0, t4, 0x31);
+	m[w0 + 5] = _mm256_permute2x128_si256(t1, t5, 0x31);
+	m[w0 + 6] = _mm256_permute2x128_si256(t2, t6, 0x31);
+	m[w0 + 7] = _mm256_permute2x128_si256(t3, t7, 0x31);
+}
+
+#define ADD(x, y) _mm256_add_epi32(x, y)
+#define SET1(t) _mm256_set1_epi32((int)(t))
+#define ROL(x, s) _mm256_or_si256(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - (s)))
+#define F(x, y, z) _mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y, z)))
+#define G(x, y, z) _mm256_xor_si256(y, _mm256_and_si256(z, _mm256_xor_si256(x, y)))
+#define H(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define I(x, y, z) _mm256_xor_si256(y, _mm256_or_si256(x, _mm256_xor_si256(z, ones)))
+
+/* blocks blocks of up to 8 lanes, the missing ones hash the first again */
+__attribute__((target("avx2")))
+static void md5_blocks_avx2(struct md5mb_lane *lane, unsigned count, size_t blocks)
+{
+	const unsigned char *p[8];
+	uint32_t h[4][8];
+	__m256i m[16];
+	__m256i a, b, c, d, a0, b0, c0, d0;
+	__m256i ones = _mm256_set1_epi32(-1);
+	unsigned i, k;
+
+	for (i = 0; i < 8; ++i) {
+		const struct md5mb_lane *l = &lane[i < count ? i : 0];
+		p[i] = l->p;
+		for (k = 0; k < 4; ++k) h[k][i] = l->s->h[k];
+	}
+	a = _mm256_loadu_si256((const __m256i *)h[0]);
+	b = _mm256_loadu_si256((const __m256i *)h[1]);
+	c = _mm256_loadu_si256((const __m256i *)h[2]);
+	d = _mm256_loadu_si256((const __m256i *)h[3]);
+	for (; blocks > 0; --blocks) {
+		md5_transpose8(m, p, 0);
+		md5_transpose8(m, p, 8);
+		for (i = 0; i < 8; ++i) p[i] += 64;
+		a0 = a;
+		b0 = b;
+		c0 = c;
+		d0 = d;
+		MD5_ROUNDS
+		a = ADD(a, a0);
+		b = ADD(b, b0);
+		c = ADD(c, c0);
+		d = ADD(d, d0);
+	}
+	_mm256_storeu_si256((__m256i *)h[0], a);
+	_mm256_storeu_si256((__m256i *)h[1], b);
+	_mm256_storeu_si256((__m256i *)h[2], c);
+	_mm256_storeu_si256((__m256i *)h[3], d);
+	for (i = 0; i < count; ++i) {
+		for (k = 0; k < 4; ++k) lane[i].s->h[k] = h[k][i];
+	}
+}
+
+#undef ADD
+#undef SET1
+#undef ROL
+#undef F
+#undef G
+#undef H
+#undef I
+
+#define ADD(x, y) _mm512_add_epi32(x, y)
+#define SET1(t) _mm512_set1_epi32((int)(t))
+#define ROL(x, s) _mm512_rol_epi32(x, s)
+#define F(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0xca)
+#define G(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0xe4)
+#define H(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0x96)
+#define I(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0x39)
+
+/* blocks blocks of up to 16 lanes, the missing ones hash the first again */
+__attribute__((target("avx512f,avx2")))
+static void md5_blocks_avx512(struct md5mb_lane *lane, unsigned count, size_t blocks)
+{
+	const unsigned char *p[16];
+	uint32_t h[4][16];
+	__m256i lo[16], hi[16];
+	__m512i m[16];
+	__m512i a, b, c, d, a0, b0, c0, d0;
+	unsigned i, k;
+
+	for (i = 0; i < 16; ++i) {
+		const struct md5mb_lane *l = &lane[i < count ? i : 0];
+		p[i] = l->p;
+		for (k = 0; k < 4; ++k) h[k][i] = l->s->h[k];
+	}
+	a = _mm512_loadu_si512(h[0]);
+	b = _mm512_loadu_si512(h[1]);
+	c = _mm512_loadu_si512(h[2]);
+	d = _mm512_loadu_si512(h[3]);
+	for (; blocks > 0; --blocks) {
+		md5_transpose8(lo, p, 0);
+		md5_transpose8(lo, p, 8);
+		md5_transpose8(hi, p + 8, 0);
+		md5_transpose8(hi, p + 8, 8);
+		for (i = 0; i < 16; ++i) {
+			m[i] = _mm512_inserti64x4(_mm512_castsi256_si512(lo[i]), hi[i], 1);
+			p[i] += 64;
+		}
+		a0 = a;
+		b0 = b;
+		c0 = c;
+		d0 = d;
+		MD5_ROUNDS
+		a = ADD(a, a0);
+		b = ADD(b, b0);
+		c = ADD(c, c0);
+		d = ADD(d, d0);
+	}
+	_mm512_storeu_si512(h[0], a);
+	_mm512_storeu_si512(h[1], b);
+	_mm512_storeu_si512(h[2], c);
+	_mm512_storeu_si512(h[3], d);
+	for (i = 0; i < count; ++i) {
+		for (k = 0; k < 4; ++k) lane[i].s->h[k] = h[k][i];
+	}
+}
+
+#undef ADD
+#undef SET1
+#undef ROL
+#undef F
+#undef G
+#undef H
+#undef I
+#endif
+
+unsigned md5mb_lanes(void)
+{
+	static unsigned lanes = 0;
+
+	if (!lanes) {
+		lanes = 1;
+#ifdef MD5MB_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f")) {
+			lanes = 16;
+		} else if (__builtin_cpu_supports("avx2")) {
+			lanes = 8;
+		}
+#endif
+	}
+	return lanes;
+}
+
+void md5mb_init(struct md5mb_stream *s)
+{
+	s->h[0] = 0x67452301;
+	s->h[1] = 0xefcdab89;
+	s->h[2] = 0x98badcfe;
+	s->h[3] = 0x10325476;
+	s->len = 0;
+	s->buf_len = 0;
+}
+
+void md5mb_update(struct md5mb_stream *s, const void *data, size_t size)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	size_t n;
+
+	s->len += size;
+	if (s->buf_len) {
+		n = 64 - s->buf_len < size ? 64 - s->buf_len : size;
+		memcpy(s->buf + s->buf_len, p, n);
+		s->buf_len += n;
+		p += n;
+		size -= n;
+		if (s->buf_len < 64) return;
+		md5_blocks(s->h, s->buf, 1);
+		s->buf_len = 0;
+	}
+	md5_blocks(s->h, p, size / 64);
+	p += size / 64 * 64;
+	memcpy(s->buf, p, size % 64);
+	s->buf_len = size % 64;
+}
+
+/* the lane is done with its whole blocks */
+static void md5mb_lane_end(struct md5mb_lane *l)
+{
+	md5mb_update(l->s, l->p, l->tail);
+}
+
+void md5mb_update_many(struct md5mb_stream **s, const unsigned char **data,
+                       const size_t *len, unsigned count)
+{
+	struct md5mb_lane lane[MD5MB_MAX_LANES];
+	unsigned lanes = md5mb_lanes();
+	unsigned active = 0, next = 0, i, j;
+	size_t blocks;
+
+	for (;;) {
+		while (active < lanes && next < count) {
+			i = next++;
+			if (s[i]->buf_len || len[i] < 64) {
+				md5mb_update(s[i], data[i], len[i]);
+				continue;
+			}
+			lane[active].s = s[i];
+			lane[active].p = data[i];
+			lane[active].blocks = len[i] / 64;
+			lane[active].tail = len[i] % 64;
+			++active;
+		}
+		if (!active) break;
+		/* a kernel pass costs about two scalar streams, whatever the
+		 * number of lanes in use */
+		if (lanes == 1 || active == 1) {
+			for (i = 0; i < active; ++i) {
+				md5_blocks(lane[i].s->h, lane[i].p, lane[i].blocks);
+				lane[i].s->len += lane[i].blocks * 64;
+				lane[i].p += lane[i].blocks * 64;
+				md5mb_lane_end(&lane[i]);
+			}
+			active = 0;
+			continue;
+		}
+		blocks = lane[0].blocks;
+		for (i = 1; i < active; ++i) {
+			if (lane[i].blocks < blocks) blocks = lane[i].blocks;
+		}
+#ifdef MD5MB_X86
+		if (lanes == 16) {
+			md5_blocks_avx512(lane, active, blocks);
+		} else {
+			md5_blocks_avx2(lane, active, blocks);
+		}
+#endif
+		for (i = j = 0; i < active; ++i) {
+			lane[i].s->len += blocks * 64;
+			lane[i].p += blocks * 64;
+			lane[i].blocks -= blocks;
+			if (lane[i].blocks) {
+				lane[j++] = lane[i];
+			} else {
+				md5mb_lane_end(&lane[i]);
+			}
+		}
+		active = j;
+	}
+}
+
+void md5mb_final(struct md5mb_stream *s, unsigned char *digest)
+{
+	unsigned long long bits = s->len * 8;
+	unsigned char pad[72];
+	size_t pad_len = (s->buf_len < 56 ? 56 : 120) - s->buf_len;
+	unsigned i;
+
+	memset(pad, 0, sizeof (pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; ++i) pad[pad_len + i] = (unsigned char)(bits >> (i * 8));
+	md5mb_update(s, pad, pad_len + 8);
+	for (i = 0; i < 16; ++i) digest[i] = (unsigned char)(s->h[i / 4] >> (i % 4 * 8));
+}
@@ -0,0 +1,31 @@
+#ifndef md5mb_h_
+#define md5mb_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Multi-buffer MD5: a single MD5 stream cannot be vectorized, but the
+ * streams of several files can be hashed in lockstep in the lanes of
+ * AVX2 (8) or AVX-512 (16). The kernel is chosen at run time, with a
+ * scalar fallback. The digests are plain MD5. */
+#define MD5MB_MAX_LANES 16
+
+struct md5mb_stream {
+	uint32_t h[4];
+	unsigned long long len;
+	unsigned char buf[64];
+	size_t buf_len;
+};
+
+/* streams hashed at once by the best kernel of this CPU, 1 without SIMD */
+unsigned md5mb_lanes(void);
+
+void md5mb_init(struct md5mb_stream *s);
+void md5mb_update(struct md5mb_stream *s, const void *data, size_t size);
+/* hash len[i] bytes of data[i] into s[i] for each i < count, the whole
+ * blocks of the streams in lockstep */
+void md5mb_update_many(struct md5mb_stream **s, const unsigned char **data,
+                       const size_t *len, unsigned count);
+void md5mb_final(struct md5mb_stream *s, unsigned char *digest);
+
+#endif
@@ -11,13 +11,15 @@
 
 MemPool<char> string_pool;
 MemPool<Node> NodePoolAlloc::pool;
+// dev and ino from xmd5 -i, out of the nodes so they cost nothing without it
+static std::map<const Node *, Node::Inode> node_inodes;
 
 Node::Node(const char *n, size_t n_size, bool vnode) :
 	size(0), parent(NULL), child(NULL),
 	sibling(NULL), group(NULL), child_count(0),
 	sibling_dupe(false), parent_dupe(false),
 	slave(false), visited(false), vnode(vnode),
-	last_child(false), keep(false)
+	last_child(false), keep(false), has_inode(false)
 {
 	name = string_pool.alloc(n_size + 1);
 	memcpy(name, n, n_size);
@@ -26,6 +28,32 @@ Node::Node(const char *n, size_t n_size, bool vnode) :
 
 Node::~Node() {
 	string_pool.free(name);
+	if (has_inode) node_inodes.erase(this);
+}
+
+// an ino of 0 is unknown
+void Node::set_inode(unsigned long long dev, unsigned long long ino)
+{
+	if (!ino) {
+		if (has_inode) node_inodes.erase(this);
+		has_inode = false;
+		return;
+	}
+	node_inodes[this] = Inode(dev, ino);
+	has_inode = true;
+}
+
+// (0, 0) if unknown
+Node::Inode Node::get_inode() const
+{
+	if (!has_inode) return Inode(0, 0);
+	return node_inodes.find(this)->second;
+}
+
+// whether any node has an inode, the listings without -i have none
+bool Node::has_inodes()
+{
+	return !node_inodes.empty();
 }
 
 Node *Node::insert_node(const char *path, unsigned long long size)
@@ -517,6 +545,36 @@ void Node::print_only_in_list(Node *origin)
 	}
 }
 
+// size of the files under this node that are hardlinks of a file already
+// in inodes, the others are added to inodes
+unsigned long long Node::linked_size(InodeSet &inodes) const
+{
+	// the vnode of an archive has the inode of the archive
+	if (!child || (vnode && has_inode)) {
+		if (!has_inode) return 0;
+		return inodes.insert(std::make_pair(get_inode(), vnode)).second ? 0 : size;
+	}
+
+	unsigned long long res = 0;
+	for (const Node *p = child; p; p = p->sibling) {
+		if (!p->vnode) res += p->linked_size(inodes);
+	}
+	return res;
+}
+
+// add the inodes of the files kept by find_keepers()
+void Node::kept_inodes(InodeSet &inodes) const
+{
+	if (!keep) return;
+	if (!child) {
+		if (has_inode) inodes.insert(std::make_pair(get_inode(), false));
+		return;
+	}
+	for (const Node *p = child; p; p = p->sibling) {
+		if (!p->vnode) p->kept_inodes(inodes);
+	}
+}
+
 unsigned long long Node::get_group_size()
 {
 	if (!group) return 0;
@@ -524,6 +582,7 @@ unsigned long long Node::get_group_size()
 	bool have_master_size = false;
 	unsigned long long total_size = 0;
 	unsigned long long master_size = 0;
+	Node *master = NULL;
 	bool first = true;
 	for (Node *p = this; first || p != this; p = p->group, first = false) {
 		if (!p->parent_dupe) {
@@ -533,14 +592,28 @@ unsigned long long Node::get_group_size()
 			if (have_master_size) {
 				if (p->size < master_size) {
 					master_size = p->size;
+					master = p;
 				}
 			} else {
 				master_size = p->size;
+				master = p;
 				have_master_size = true;
 			}
 		}
 	}
 
+	// hardlinks of the kept files free nothing
+	if (has_inodes()) {
+		InodeSet inodes;
+		if (master) master->linked_size(inodes);
+		first = true;
+		for (Node *p = this; first || p != this; p = p->group, first = false) {
+			if (p != master && !p->parent_dupe) {
+				total_size -= p->linked_size(inodes);
+			}
+		}
+	}
+
 	return total_size - master_size;
 }
 
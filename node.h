@@ -3,6 +3,8 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <utility>
 #include "mempool.h"
 
 struct Node;
@@ -25,6 +27,11 @@ struct Node : public NodePoolAlloc {
 		Node *group;
 	};
 
+	typedef std::pair<unsigned long long, unsigned long long> Inode;
+	// the inodes of vnodes, the archives they stand for, are apart from
+	// those of the files: a vnode is not a hardlink of its archive file
+	typedef std::set<std::pair<Inode, bool> > InodeSet;
+
 	unsigned long long  size;
 	char                *name;
 	Node                *parent;
@@ -39,6 +46,7 @@ struct Node : public NodePoolAlloc {
 	bool                vnode:1;
 	bool                last_child:1;
 	bool                keep:1;
+	bool                has_inode:1; // dev and ino from xmd5 -i in node_inodes
 
 	Node *insert_node(const char *path, unsigned long long size);
 	void resize_vnodes(unsigned long long vnode_size = 0,
@@ -58,6 +66,11 @@ struct Node : public NodePoolAlloc {
 	bool group_dir(bool equal_only);
 	bool group_dirs(bool equal_only);
 	void print_only_in_list(Node *origin);
+	unsigned long long linked_size(InodeSet &inodes) const;
+	void kept_inodes(InodeSet &inodes) const;
+	void set_inode(unsigned long long dev, unsigned long long ino);
+	Inode get_inode() const;
+	static bool has_inodes();
 	unsigned long long get_group_size();
 	bool is_child_group();
 	size_t build_count_group_list(GroupListElt *dest, bool child_groups);
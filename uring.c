@@ -0,0 +1,112 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+int uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq_ring, *cq_ring;
+
+	memset(r, 0, sizeof (*r));
+	memset(&p, 0, sizeof (p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) return -1;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) goto bad_ring;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+		                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) goto bad_ring2;
+	}
+	r->sqes = (struct io_uring_sqe *)
+		mmap(NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+		     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		     r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto bad_ring3;
+
+	sq_ring = (char *)r->sq_ring;
+	cq_ring = (char *)r->cq_ring;
+	r->sq_entries = p.sq_entries;
+	r->sq_head = (unsigned *)(sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq_ring + p.sq_off.array);
+	r->sqe_tail = *r->sq_tail;
+	r->cq_head = (unsigned *)(cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq_ring + p.cq_off.cqes);
+	return 0;
+bad_ring3:
+	if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+bad_ring2:
+	munmap(r->sq_ring, r->sq_ring_size);
+bad_ring:
+	close(r->fd);
+	r->fd = -1;
+	return -1;
+}
+
+void uring_exit(struct uring *r)
+{
+	if (r->fd < 0) return;
+	munmap(r->sqes, r->sq_entries * sizeof (struct io_uring_sqe));
+	if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	r->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (r->sqe_tail - head >= r->sq_entries) return NULL;
+	sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+	memset(sqe, 0, sizeof (*sqe));
+	r->sq_array[r->sqe_tail & *r->sq_mask] = r->sqe_tail & *r->sq_mask;
+	++r->sqe_tail;
+	return sqe;
+}
+
+int uring_submit_and_wait(struct uring *r, unsigned wait_nr)
+{
+	unsigned to_submit;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	/* entries left by an interrupted call are submitted again */
+	to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	ret = syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr,
+	              wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret < 0 && errno == EINTR) ret = 0;
+	return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+	unsigned head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,37 @@
+#ifndef uring_h_
+#define uring_h_
+
+#include <linux/io_uring.h>
+
+/* Minimal io_uring wrapper over the raw system calls, so that xmd5 does not
+ * need liburing. Not thread safe, one ring per thread. */
+struct uring {
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sqe_tail;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+/* zeroed submission entry, NULL when the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+/* submit the pending entries and wait for wait_nr completions */
+int uring_submit_and_wait(struct uring *r, unsigned wait_nr);
+/* next completion, NULL if none; uring_cqe_seen releases it */
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+#endif
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xlist.h"
+
+const char *get_escape_pt(const char *filename_pt, const char **prepl)
+{
+	const char *pt;
+	for (pt = filename_pt; *pt; ++pt) {
+		if (*pt == '\n') {
+			*prepl = "%lf;";
+			return pt;
+		} else if (*pt == '\r') {
+			*prepl = "%cr;";
+			return pt;
+		} else if (*pt == '%') {
+			if ((pt[1] == '%' && pt[2] == '%' && pt[3] == '%') ||
+			    (pt[1] == '#' && pt[2] == '0' && pt[3] == ';') ||
+			    (pt[1] == 'l' && pt[2] == 'f' && pt[3] == ';') ||
+			    (pt[1] == 'c' && pt[2] == 'r' && pt[3] == ';') ||
+			    (pt[1] == 'p' && pt[2] == 'c' && pt[3] == ';')) {
+				*prepl = "%pc;";
+				return pt;
+			}
+		}
+	}
+	return NULL;
+}
+
+char *escape_filename(const char *filename)
+{
+	const char *cp;
+	char *output = (char *)filename;
+	size_t output_size = 1;
+	int need_replace = 0;
+
+	for (cp = filename; *cp; ) {
+		const char *repl = NULL;
+		const char *nextp = get_escape_pt(cp, &repl);
+		if (nextp) {
+			output_size += (nextp - cp) + strlen(repl);
+			need_replace = 1;
+			cp = nextp + 1;
+		} else {
+			output_size += strlen(cp);
+			break;
+		}
+	}
+
+	if (need_replace) {
+		output = (char *)malloc(output_size);
+		if (output) {
+			char *poutput = output;
+			for (cp = filename; *cp; ) {
+				const char *repl = NULL;
+				const char *nextp = get_escape_pt(cp, &repl);
+				if (nextp) {
+					size_t repl_len = strlen(repl);
+					memcpy(poutput, cp, nextp - cp);
+					poutput += nextp - cp;
+					memcpy(poutput, repl, repl_len + 1);
+					poutput += repl_len;
+					cp = nextp + 1;
+				} else {
+					strcpy(poutput, cp);
+					break;
+				}
+			}
+		}
+	}
+
+	return output;
+}
+
+static int reserve(char **buf, size_t *alloc, size_t size)
+{
+	if (size > *alloc) {
+		size_t new_alloc = *alloc ? *alloc : 256;
+		char *t;
+		while (new_alloc < size) new_alloc *= 2;
+		if (!(t = (char *)realloc(*buf, new_alloc))) return -1;
+		*buf = t;
+		*alloc = new_alloc;
+	}
+	return 0;
+}
+
+static int put_varint(FILE *f, unsigned long long v)
+{
+	do {
+		int c = v & 0x7f;
+		v >>= 7;
+		if (v) c |= 0x80;
+		if (putc_unlocked(c, f) == EOF) return -1;
+	} while (v);
+	return 0;
+}
+
+static int get_varint(FILE *f, unsigned long long *v)
+{
+	unsigned shift = 0;
+	int c;
+
+	*v = 0;
+	do {
+		if (shift > 63 || (c = getc_unlocked(f)) == EOF) return -1;
+		*v |= (unsigned long long)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+int xlist_write_open(struct xlist *x, FILE *f, const char *tag,
+                     size_t digest_length, int inodes)
+{
+	memset(x, 0, sizeof (*x));
+	if (strlen(tag) > XLIST_MAX_TAG || digest_length > XLIST_MAX_DIGEST) return -1;
+	x->f = f;
+	strcpy(x->tag, tag);
+	x->digest_length = digest_length;
+	x->inodes = inodes;
+	fprintf(f, "%s%s\n", XLIST_MAGIC, tag);
+	putc(digest_length, f);
+	putc(inodes ? XLIST_HAS_INODES : 0, f);
+	return ferror(f) ? -1 : 0;
+}
+
+int xlist_write_resume(struct xlist *x, FILE *f, const char *tag,
+                       size_t digest_length, int inodes,
+                       const char *path, size_t path_len)
+{
+	memset(x, 0, sizeof (*x));
+	if (strlen(tag) > XLIST_MAX_TAG || digest_length > XLIST_MAX_DIGEST) return -1;
+	x->f = f;
+	strcpy(x->tag, tag);
+	x->digest_length = digest_length;
+	x->inodes = inodes;
+	if (reserve(&x->path, &x->path_alloc, path_len + 1) != 0) return -1;
+	memcpy(x->path, path, path_len);
+	x->path_len = path_len;
+	return 0;
+}
+
+int xlist_write(struct xlist *x, const struct xlist_entry *e)
+{
+	size_t prefix = 0;
+
+	putc_unlocked(e->flags, x->f);
+	if (e->flags & XLIST_HASH) {
+		fwrite(e->digest, 1, x->digest_length, x->f);
+	} else {
+		put_varint(x->f, e->field_len);
+		fwrite(e->field, 1, e->field_len, x->f);
+	}
+	if (e->flags & XLIST_SIZE) put_varint(x->f, e->size);
+	if (e->flags & XLIST_INODE) {
+		put_varint(x->f, e->dev);
+		put_varint(x->f, e->ino);
+	}
+	while (prefix < x->path_len && prefix < e->path_len &&
+	       x->path[prefix] == e->path[prefix]) ++prefix;
+	put_varint(x->f, prefix);
+	put_varint(x->f, e->path_len - prefix);
+	fwrite(e->path + prefix, 1, e->path_len - prefix, x->f);
+
+	if (reserve(&x->path, &x->path_alloc, e->path_len + 1) != 0) return -1;
+	memcpy(x->path + prefix, e->path + prefix, e->path_len - prefix);
+	x->path_len = e->path_len;
+	return ferror(x->f) ? -1 : 0;
+}
+
+/* raw form of an escaped name, never longer than it */
+static size_t unescape_name(const char *p, const char *end, char *dst)
+{
+	char *d = dst;
+
+	while (p < end) {
+		if (*p == '%' && end - p >= 4) {
+			const char *repl = NULL;
+			if (memcmp(p, "%%%%", 4) == 0) {
+				repl = "\0a";
+			} else if (memcmp(p, "%#0;", 4) == 0) {
+				repl = "\0#";
+			} else if (memcmp(p, "%lf;", 4) == 0) {
+				repl = "\n";
+			} else if (memcmp(p, "%cr;", 4) == 0) {
+				repl = "\r";
+			} else if (memcmp(p, "%pc;", 4) == 0) {
+				repl = "%";
+			}
+			if (repl) {
+				*d++ = repl[0];
+				if (repl[0] == '\0') *d++ = repl[1];
+				p += 4;
+				continue;
+			}
+		}
+		*d++ = *p++;
+	}
+	return d - dst;
+}
+
+int xlist_write_line(struct xlist *x, const char *line, size_t len)
+{
+	const char *p = line, *end = line + len;
+	const char *size_p;
+	struct xlist_entry e;
+	size_t tag_len = strlen(x->tag);
+	size_t i;
+
+	memset(&e, 0, sizeof (e));
+	e.field = p;
+	while (p < end && *p != ' ') ++p;
+	e.field_len = p - e.field;
+	while (p < end && *p == ' ') ++p;
+	size_p = p;
+	while (p < end && *p != ' ') ++p;
+	if (p >= end || size_p == p) return -1;
+	if (!(p - size_p == 1 && *size_p == 'X')) {
+		for (; size_p < p; ++size_p) {
+			if (*size_p < '0' || *size_p > '9') return -1;
+			e.size = e.size * 10 + (*size_p - '0');
+		}
+		e.flags |= XLIST_SIZE;
+	}
+	++p;
+
+	if (x->inodes) {
+		if (end - p >= 2 && p[0] == '-' && p[1] == ' ') {
+			p += 2;
+		} else {
+			char *q;
+			e.dev = strtoull(p, &q, 10);
+			if (q == p || q >= end || *q != ':') return -1;
+			p = q + 1;
+			e.ino = strtoull(p, &q, 10);
+			if (q == p || q >= end || *q != ' ') return -1;
+			p = q + 1;
+			e.flags |= XLIST_INODE;
+		}
+	}
+
+	if (e.field_len == tag_len + 2 * x->digest_length &&
+	    memcmp(e.field, x->tag, tag_len) == 0) {
+		for (i = 0; i < 2 * x->digest_length; ++i) {
+			if (hex_value(e.field[tag_len + i]) < 0) break;
+		}
+		if (i == 2 * x->digest_length) {
+			for (i = 0; i < x->digest_length; ++i) {
+				e.digest[i] = hex_value(e.field[tag_len + 2 * i]) << 4 |
+				              hex_value(e.field[tag_len + 2 * i + 1]);
+			}
+			e.flags |= XLIST_HASH;
+		}
+	}
+
+	if (reserve(&x->field, &x->field_alloc, end - p + 1) != 0) return -1;
+	e.path = x->field;
+	e.path_len = unescape_name(p, end, x->field);
+	return xlist_write(x, &e);
+}
+
+int xlist_read_open(struct xlist *x, FILE *f, const char *pre, size_t pre_len)
+{
+	size_t magic_len = strlen(XLIST_MAGIC);
+	char magic[sizeof (XLIST_MAGIC)];
+	size_t i;
+	int c;
+
+	memset(x, 0, sizeof (*x));
+	x->f = f;
+	if (pre_len > magic_len) return -1;
+	memcpy(magic, pre, pre_len);
+	if (fread(magic + pre_len, 1, magic_len - pre_len, f) != magic_len - pre_len ||
+	    memcmp(magic, XLIST_MAGIC, magic_len) != 0) return -1;
+	for (i = 0; (c = getc(f)) != '\n'; ++i) {
+		if (c == EOF || i >= XLIST_MAX_TAG) return -1;
+		x->tag[i] = c;
+	}
+	if ((c = getc(f)) == EOF || c > XLIST_MAX_DIGEST) return -1;
+	x->digest_length = c;
+	if ((c = getc(f)) == EOF) return -1;
+	x->inodes = (c & XLIST_HAS_INODES) != 0;
+	return 0;
+}
+
+int xlist_read(struct xlist *x, struct xlist_entry *e)
+{
+	unsigned long long prefix, rest;
+	int c;
+
+	if ((c = getc_unlocked(x->f)) == EOF) return ferror(x->f) ? -1 : 0;
+	memset(e, 0, sizeof (*e));
+	e->flags = c;
+	if (e->flags & XLIST_HASH) {
+		if (fread(e->digest, 1, x->digest_length, x->f) != x->digest_length) return -1;
+	} else {
+		unsigned long long field_len;
+		if (get_varint(x->f, &field_len) != 0 ||
+		    reserve(&x->field, &x->field_alloc, field_len + 1) != 0 ||
+		    fread(x->field, 1, field_len, x->f) != field_len) return -1;
+		x->field[field_len] = '\0';
+		e->field = x->field;
+		e->field_len = field_len;
+	}
+	if ((e->flags & XLIST_SIZE) && get_varint(x->f, &e->size) != 0) return -1;
+	if ((e->flags & XLIST_INODE) &&
+	    (get_varint(x->f, &e->dev) != 0 || get_varint(x->f, &e->ino) != 0)) return -1;
+	if (get_varint(x->f, &prefix) != 0 || prefix > x->path_len ||
+	    get_varint(x->f, &rest) != 0 ||
+	    reserve(&x->path, &x->path_alloc, prefix + rest + 1) != 0 ||
+	    fread(x->path + prefix, 1, rest, x->f) != rest) return -1;
+	x->path_len = prefix + rest;
+	x->path[x->path_len] = '\0';
+	e->path = x->path;
+	e->path_len = x->path_len;
+	return 1;
+}
+
+/* the escape_filename rule for '%' */
+static int needs_escape(const char *p, const char *end)
+{
+	if (end - p < 4) return 0;
+	return memcmp(p + 1, "%%%", 3) == 0 || memcmp(p + 1, "#0;", 3) == 0 ||
+	       memcmp(p + 1, "lf;", 3) == 0 || memcmp(p + 1, "cr;", 3) == 0 ||
+	       memcmp(p + 1, "pc;", 3) == 0;
+}
+
+char *xlist_escape_path(const char *path, size_t path_len)
+{
+	const char *p, *end = path + path_len;
+	char *res = (char *)malloc(4 * path_len + 1);
+	char *d = res;
+
+	if (!res) return NULL;
+	for (p = path; p < end; ++p) {
+		if (*p == '\0' && p + 1 < end) {
+			memcpy(d, *++p == 'a' ? "%%%%" : "%#0;", 4);
+			d += 4;
+		} else if (*p == '\n') {
+			memcpy(d, "%lf;", 4);
+			d += 4;
+		} else if (*p == '\r') {
+			memcpy(d, "%cr;", 4);
+			d += 4;
+		} else if (*p == '%' && needs_escape(p, end)) {
+			memcpy(d, "%pc;", 4);
+			d += 4;
+		} else {
+			*d++ = *p;
+		}
+	}
+	*d = '\0';
+	return res;
+}
+
+char *xlist_format_line(const struct xlist *x, const struct xlist_entry *e)
+{
+	char *path = xlist_escape_path(e->path, e->path_len);
+	char *res, *d;
+	size_t i;
+
+	if (!path) return NULL;
+	res = (char *)malloc(XLIST_MAX_TAG + 2 * XLIST_MAX_DIGEST + e->field_len +
+	                     64 + strlen(path) + 2);
+	if (!res) {
+		free(path);
+		return NULL;
+	}
+	d = res;
+	if (e->flags & XLIST_HASH) {
+		d += sprintf(d, "%s", x->tag);
+		for (i = 0; i < x->digest_length; ++i) d += sprintf(d, "%02x", e->digest[i]);
+	} else {
+		memcpy(d, e->field, e->field_len);
+		d += e->field_len;
+	}
+	if (e->flags & XLIST_SIZE) {
+		d += sprintf(d, "  %15llu ", e->size);
+	} else {
+		d += sprintf(d, "  %15s ", "X");
+	}
+	if (x->inodes) {
+		if (e->flags & XLIST_INODE) {
+			d += sprintf(d, "%llu:%llu ", e->dev, e->ino);
+		} else {
+			d += sprintf(d, "- ");
+		}
+	}
+	sprintf(d, "%s\n", path);
+	free(path);
+	return res;
+}
+
+void xlist_close(struct xlist *x)
+{
+	free(x->path);
+	free(x->field);
+	x->path = x->field = NULL;
+	x->path_alloc = x->field_alloc = 0;
+}
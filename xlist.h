@@ -0,0 +1,85 @@
+#ifndef xlist_h_
+#define xlist_h_
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Binary listing format, written by xmd5 -B and read by find_dup.
+ *
+ * header: XLIST_MAGIC, the digest tag and '\n', the digest length byte
+ *         and a flags byte (XLIST_HAS_INODES)
+ * entry:  a flags byte, the raw digest (XLIST_HASH) or the varint length
+ *         and text of the digest field, the varint size (XLIST_SIZE), the
+ *         varint dev and ino (XLIST_INODE), then the path front coded
+ *         against the previous one: varint length of the common prefix,
+ *         varint length and bytes of the rest.
+ *
+ * Paths are not escaped. As a file name cannot hold a NUL byte, NUL 'a'
+ * stands for the %%%% archive marker and NUL '#' for %#0; */
+#define XLIST_MAGIC "xmd5 list 1\n"
+#define XLIST_MAX_DIGEST 32
+#define XLIST_MAX_TAG 16
+
+#define XLIST_HAS_INODES 0x01
+
+#define XLIST_HASH 0x01
+#define XLIST_SIZE 0x02
+#define XLIST_INODE 0x04
+
+struct xlist_entry {
+	unsigned flags;
+	unsigned char digest[XLIST_MAX_DIGEST];
+	const char *field;
+	size_t field_len;
+	unsigned long long size;
+	unsigned long long dev;
+	unsigned long long ino;
+	const char *path;
+	size_t path_len;
+};
+
+struct xlist {
+	FILE *f;
+	char tag[XLIST_MAX_TAG + 1];
+	size_t digest_length;
+	int inodes;
+	char *path;
+	size_t path_len;
+	size_t path_alloc;
+	char *field;
+	size_t field_alloc;
+};
+
+const char *get_escape_pt(const char *filename_pt, const char **prepl);
+char *escape_filename(const char *filename);
+
+int xlist_write_open(struct xlist *x, FILE *f, const char *tag,
+                     size_t digest_length, int inodes);
+/* go on writing a listing, path is the last one written */
+int xlist_write_resume(struct xlist *x, FILE *f, const char *tag,
+                       size_t digest_length, int inodes,
+                       const char *path, size_t path_len);
+int xlist_write(struct xlist *x, const struct xlist_entry *e);
+/* parse and write a text listing line, without its '\n' */
+int xlist_write_line(struct xlist *x, const char *line, size_t len);
+
+/* pre is what was already read of f, to be checked against the magic */
+int xlist_read_open(struct xlist *x, FILE *f, const char *pre, size_t pre_len);
+/* 1 with an entry valid until the next call, 0 at the end, -1 on error */
+int xlist_read(struct xlist *x, struct xlist_entry *e);
+/* text listing line of an entry, with its '\n' */
+char *xlist_format_line(const struct xlist *x, const struct xlist_entry *e);
+/* escaped text form of a raw path */
+char *xlist_escape_path(const char *path, size_t path_len);
+
+void xlist_close(struct xlist *x);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,100 +1,384 @@
+#define _GNU_SOURCE
 #include <archive.h>
 #include <archive_entry.h>
 #include <openssl/md5.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/if_alg.h>
+#include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <setjmp.h>
+#include <time.h>
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+#include "uring.h"
+#include "xlist.h"
+#include "md5mb.h"
 
 /* #define DO_MTRACE */
 /* #define DO_FORK */
 /* #define NO_ARCHIVES */
-#define BLOCK_SIZE 10240
+#define ZERO_BLOCK_SIZE 65536
+#define SNIFF_SIZE 32774
+#define SPLIT_MIN_SIZE 67108864
 #define UNKNOWN_SIZE 0xFFFFFFFFFFFFFFFFull
 #define RETRY_ARCHIVE_COUNT 10
+#define JOB_QUEUE_FACTOR 16
+#define OUT_QUEUE_FACTOR 64
+#define HASH_GAP_SIZE 1048576
+#define PARTIAL_SIZE 65536
+#define READ_SIZE 1048576
+#define MMAP_MIN_SIZE 16777216
+#define DENTS_SIZE 65536
+#define MAX_DIR_FDS 256
+#define ORDER_BATCH_SIZE 4096
+#define TRAV_MAX_AHEAD 65536
+#define MAX_THREADS 4096
+#define MAX_READ_SIZE 1073741824
+#define THROTTLE_BURST 100000000ull
+#define BACKOFF_MIN 1000000ull
+#define BACKOFF_MAX 100000000ull
+#define CHECKPOINT_INTERVAL 300
+#define CHECKPOINT_MAGIC "xmd5 checkpoint 1\n"
+#define STATS_INTERVAL 10
+#define SORT_MEMORY 67108864
+#define MAX_RUNS 64
+#define URING_FILES 32
+#define URING_FILE_READS 4
+#define URING_BLOCK_SIZE 131072
+#define MAX_DIGEST_LENGTH MD5_DIGEST_LENGTH
+#define MAX_DIGEST_STR_LENGTH (16 + MAX_DIGEST_LENGTH * 2)
 
 #ifdef DO_MTRACE
 #include <mcheck.h>
 #endif
 
+/* Content hashes, selected with -H. md5 digests are written bare for
+ * compatibility, the others are tagged with the algorithm name. */
+enum {
+	HASH_MD5,
+	HASH_XXH128
+};
+
+struct hash_algo {
+	const char *name;
+	const char *tag;
+	size_t digest_length;
+	/* name of the kernel hash for -k, NULL if there is none */
+	const char *alg;
+};
+
+static const struct hash_algo hash_algos[] = {
+	{ "md5", "", MD5_DIGEST_LENGTH, "md5" },
+	{ "xxh128", "xxh128:", sizeof (XXH128_canonical_t), NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+unsigned option_jobs = 1;
+unsigned option_trav_threads = 0;
+unsigned option_archive_jobs = 1;
+unsigned option_nest_depth = 0;
+int      option_hash = HASH_MD5;
+#ifdef NO_ARCHIVES
+int      option_archives = 0;
+#else
+int      option_archives = 1;
+#endif
+int      option_uring = 0;
+int      option_all_archives = 0;
+int      option_size_filter = 0;
+int      option_partial = 0;
+size_t   option_read_size = READ_SIZE;
+int      option_noreuse = 0;
+int      option_mmap = 0;
+const char *option_cache = NULL;
+int      option_disk_order = 0;
+int      option_inode = 0;
+int      option_list_cache = 0;
+int      option_binary = 0;
+size_t   option_order_batch = ORDER_BATCH_SIZE;
+unsigned long long option_rate = 0;
+unsigned long long option_file_rate = 0;
+unsigned long long option_latency = 0;
+int      option_ioprio = 0;
+const char *option_checkpoint = NULL;
+unsigned option_stats_interval = 0;
+const char *option_status = NULL;
+int      option_totals = 0;
+int      option_kernel_hash = 0;
+size_t   option_sort_memory = SORT_MEMORY;
+
 static size_t grow_size(size_t size) {
 	if (size < 1024) return 1024;
 	if (size > 1048576) return size + 1048576;
 	return size << 1;
 }
 
-const char *get_escape_pt(const char *filename_pt, const char **prepl)
-{
-	const char *pt;
-	for (pt = filename_pt; *pt; ++pt) {
-		if (*pt == '\n') {
-			*prepl = "%lf;";
-			return pt;
-		} else if (*pt == '\r') {
-			*prepl = "%cr;";
-			return pt;
-		} else if (*pt == '%') {
-			if ((pt[1] == '%' && pt[2] == '%' && pt[3] == '%') ||
-			    (pt[1] == '#' && pt[2] == '0' && pt[3] == ';') ||
-			    (pt[1] == 'l' && pt[2] == 'f' && pt[3] == ';') ||
-			    (pt[1] == 'c' && pt[2] == 'r' && pt[3] == ';') ||
-			    (pt[1] == 'p' && pt[2] == 'c' && pt[3] == ';')) {
-				*prepl = "%pc;";
-				return pt;
-			}
-		}
+struct xbuf {
+	char *data;
+	size_t len;
+	size_t alloc_size;
+};
+
+static int xbuf_reserve(struct xbuf *b, size_t size)
+{
+	if (b->len + size > b->alloc_size) {
+		size_t new_size = b->alloc_size;
+		char *t;
+		while (b->len + size > new_size) new_size = grow_size(new_size);
+		t = (char *)realloc(b->data, new_size);
+		if (!t) return -1;
+		b->data = t;
+		b->alloc_size = new_size;
 	}
-	return NULL;
+	return 0;
 }
 
-char *escape_filename(const char *filename)
+int xbuf_write(struct xbuf *b, const void *data, size_t size)
 {
-	const char *cp;
-	char *output = (char *)filename;
-	size_t output_size = 1;
-	int need_replace = 0;
+	if (xbuf_reserve(b, size) != 0) return -1;
+	memcpy(b->data + b->len, data, size);
+	b->len += size;
+	return 0;
+}
 
-	for (cp = filename; *cp; ) {
-		const char *repl = NULL;
-		const char *nextp = get_escape_pt(cp, &repl);
-		if (nextp) {
-			output_size += (nextp - cp) + strlen(repl);
-			need_replace = 1;
-			cp = nextp + 1;
-		} else {
-			output_size += strlen(cp);
-			break;
+int xbuf_printf(struct xbuf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int size;
+
+	va_start(ap, fmt);
+	size = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (size < 0 || xbuf_reserve(b, size + 1) != 0) return -1;
+	va_start(ap, fmt);
+	vsnprintf(b->data + b->len, size + 1, fmt, ap);
+	va_end(ap);
+	b->len += size;
+	return size;
+}
+
+void xbuf_free(struct xbuf *b)
+{
+	free(b->data);
+	b->data = NULL;
+	b->len = b->alloc_size = 0;
+}
+
+/* append src to b and empty it, taking over the buffer of src when it
+ * holds more, so that a large listing is not copied */
+int xbuf_append(struct xbuf *b, struct xbuf *src)
+{
+	struct xbuf t;
+	int ret = 0;
+
+	if (src->len <= b->len) {
+		ret = xbuf_write(b, src->data, src->len);
+	} else if (xbuf_reserve(src, b->len) != 0) {
+		ret = -1;
+	} else {
+		memmove(src->data + b->len, src->data, src->len);
+		memcpy(src->data, b->data, b->len);
+		src->len += b->len;
+		t = *b;
+		*b = *src;
+		*src = t;
+	}
+	xbuf_free(src);
+	return ret;
+}
+
+struct xhash {
+	union {
+		MD5_CTX md5;
+		XXH3_state_t xxh128;
+	} c;
+};
+
+int xhash_init(struct xhash *h)
+{
+	switch (option_hash) {
+	case HASH_XXH128:
+		return XXH3_128bits_reset(&h->c.xxh128) == XXH_OK ? 0 : -1;
+	default:
+		return MD5_Init(&h->c.md5) == 1 ? 0 : -1;
+	}
+}
+
+int xhash_update(struct xhash *h, const void *data, size_t size)
+{
+	switch (option_hash) {
+	case HASH_XXH128:
+		return XXH3_128bits_update(&h->c.xxh128, data, size) == XXH_OK ? 0 : -1;
+	default:
+		return MD5_Update(&h->c.md5, data, size) == 1 ? 0 : -1;
+	}
+}
+
+/* digest is hash_algos[option_hash].digest_length bytes long */
+int xhash_final(struct xhash *h, unsigned char *digest)
+{
+	switch (option_hash) {
+	case HASH_XXH128:
+		XXH128_canonicalFromHash((XXH128_canonical_t *)digest,
+		                         XXH3_128bits_digest(&h->c.xxh128));
+		return 0;
+	default:
+		return MD5_Final(digest, &h->c.md5) == 1 ? 0 : -1;
+	}
+}
+
+/* tagged hex digest, dst must hold MAX_DIGEST_STR_LENGTH + 1 chars */
+int format_digest(char *dst, const unsigned char *digest)
+{
+	const struct hash_algo *algo = &hash_algos[option_hash];
+	char *p = dst;
+	size_t i;
+
+	strcpy(p, algo->tag);
+	p += strlen(algo->tag);
+	for (i = 0; i < algo->digest_length; ++i) {
+		sprintf(p, "%02x", digest[i]);
+		p += 2;
+	}
+	return p - dst;
+}
+
+/* Open addressing hash table of fixed size records. The key is the first
+ * key_size bytes of the record, so keys must not contain padding garbage. */
+struct htable {
+	char *recs;
+	unsigned char *used;
+	size_t rec_size;
+	size_t key_size;
+	size_t alloc_size;
+	size_t count;
+};
+
+static size_t htable_hash(const void *key, size_t key_size)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	unsigned long long h = 0xcbf29ce484222325ull;
+	size_t i;
+
+	for (i = 0; i < key_size; ++i) {
+		h ^= p[i];
+		h *= 0x100000001b3ull;
+	}
+	return h ^ (h >> 32);
+}
+
+static void *htable_slot(const struct htable *t, const void *key, int *found)
+{
+	size_t i = htable_hash(key, t->key_size) & (t->alloc_size - 1);
+
+	while (t->used[i]) {
+		char *rec = t->recs + i * t->rec_size;
+		if (memcmp(rec, key, t->key_size) == 0) {
+			*found = 1;
+			return rec;
 		}
+		i = (i + 1) & (t->alloc_size - 1);
 	}
+	*found = 0;
+	return t->recs + i * t->rec_size;
+}
 
-	if (need_replace) {
-		output = (char *)malloc(output_size);
-		if (output) {
-			char *poutput = output;
-			for (cp = filename; *cp; ) {
-				const char *repl = NULL;
-				const char *nextp = get_escape_pt(cp, &repl);
-				if (nextp) {
-					size_t repl_len = strlen(repl);
-					memcpy(poutput, cp, nextp - cp);
-					poutput += nextp - cp;
-					memcpy(poutput, repl, repl_len + 1);
-					poutput += repl_len;
-					cp = nextp + 1;
-				} else {
-					strcpy(poutput, cp);
-					break;
-				}
-			}
+void *htable_find(const struct htable *t, const void *key)
+{
+	int found;
+	void *rec;
+
+	if (t->count == 0) return NULL;
+	rec = htable_slot(t, key, &found);
+	return found ? rec : NULL;
+}
+
+/* returns the record for key, a zeroed new one if created is set */
+void *htable_insert(struct htable *t, const void *key, int *created)
+{
+	int found;
+	char *rec;
+
+	if ((t->count + 1) * 4 > t->alloc_size * 3) {
+		struct htable nt = *t;
+		size_t i;
+
+		nt.alloc_size = t->alloc_size ? t->alloc_size * 2 : 1024;
+		nt.recs = (char *)calloc(nt.alloc_size, t->rec_size);
+		nt.used = (unsigned char *)calloc(nt.alloc_size, 1);
+		if (!nt.recs || !nt.used) {
+			free(nt.recs);
+			free(nt.used);
+			return NULL;
+		}
+		for (i = 0; i < t->alloc_size; ++i) {
+			char *old_rec = t->recs + i * t->rec_size;
+			if (!t->used[i]) continue;
+			rec = (char *)htable_slot(&nt, old_rec, &found);
+			memcpy(rec, old_rec, t->rec_size);
+			nt.used[(rec - nt.recs) / t->rec_size] = 1;
 		}
+		free(t->recs);
+		free(t->used);
+		*t = nt;
 	}
+	rec = (char *)htable_slot(t, key, &found);
+	if (created) *created = !found;
+	if (!found) {
+		memset(rec, 0, t->rec_size);
+		memcpy(rec, key, t->key_size);
+		t->used[(rec - t->recs) / t->rec_size] = 1;
+		++t->count;
+	}
+	return rec;
+}
 
-	return output;
+void htable_free(struct htable *t)
+{
+	free(t->recs);
+	free(t->used);
+	t->recs = NULL;
+	t->used = NULL;
+	t->alloc_size = t->count = 0;
+}
+
+/* metadata identifying one version of a file */
+struct file_key {
+	unsigned long long dev;
+	unsigned long long ino;
+	unsigned long long size;
+	unsigned long long mtime_ns;
+	unsigned long long ctime_ns;
+};
+
+static void set_file_key(struct file_key *k, const struct stat *st)
+{
+	memset(k, 0, sizeof (*k));
+	k->dev = st->st_dev;
+	k->ino = st->st_ino;
+	k->size = st->st_size;
+	k->mtime_ns = st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec;
+	k->ctime_ns = st->st_ctim.tv_sec * 1000000000ull + st->st_ctim.tv_nsec;
 }
 
 void set_xerror(char *xerror, size_t xerror_size,
@@ -129,19 +413,46 @@ void set_xerror(char *xerror, size_t xerror_size,
 	xerror[xerror_size - 1] = '\0';
 }
 
-void print_error_line(const char *error, const char *error2, const char *escaped_filename)
+void print_error_line(const char *error, const char *error2,
+                      const char *escaped_filename, struct xbuf *out)
 {
 	char xerror[MD5_DIGEST_LENGTH * 2 + 1];
 
 	set_xerror(xerror, sizeof(xerror), error, error2);
-	printf("%s                X %s\n", xerror, escaped_filename);
+	xbuf_printf(out, "%s                X %s\n", xerror, escaped_filename);
 }
 
 
-int sort_str_with_xmd5(const void *a, const void *b)
+void print_hash_line(const unsigned char *digest, unsigned long long size,
+                     const char *escaped_filename, struct xbuf *out)
+{
+	char digest_str[MAX_DIGEST_STR_LENGTH + 1];
+
+	format_digest(digest_str, digest);
+	xbuf_printf(out, "%s  %15llu %s\n", digest_str, size, escaped_filename);
+}
+
+/* line for a regular file that was not read; the size is kept for
+ * find_dup, the digest field is not a valid md5 so it is never grouped */
+void print_unread_line(const char *reason, unsigned long long size,
+                       const char *escaped_filename, struct xbuf *out)
+{
+	char xerror[MD5_DIGEST_LENGTH * 2 + 1];
+
+	set_xerror(xerror, sizeof(xerror), reason, NULL);
+	xbuf_printf(out, "%s  %15llu %s\n", xerror, size, escaped_filename);
+}
+
+static const char *get_name_field(const char *line)
+{
+	while (*line != ' ' && *line != '\n' && *line != '\0') ++line;
+	while (*line == ' ') ++line;
+	while (*line != ' ' && *line != '\n' && *line != '\0') ++line;
+	return *line == ' ' ? line + 1 : NULL;
+}
+
+int cmp_str_with_xmd5(const char *a_str, const char *b_str)
 {
-	const char *a_str = *(char * const *)a;
-	const char *b_str = *(char * const *)b;
 	while (*a_str != ' ' && *a_str != '\0') ++a_str;
 	while (*a_str == ' ') ++a_str;
 	while (*a_str != ' ' && *a_str != '\0') ++a_str;
@@ -153,341 +464,4727 @@ int sort_str_with_xmd5(const void *a, const void *b)
 	return strcmp(a_str, b_str);
 }
 
-int do_xmd5_archive(const char *filename, const char *escaped_filename)
+int sort_str_with_xmd5(const void *a, const void *b)
 {
-	char **flist = NULL;
-	char **flist_p = NULL;
-	size_t flist_alloc_size = 0;
-	char **p;
-	struct archive *a;
-	struct archive_entry *entry;
-	void *buf = NULL;
-	int rh_ret, open_ret;
-	int retry, j;
-	unsigned long long name_error_counter = 0;
+	return cmp_str_with_xmd5(*(char * const *)a, *(char * const *)b);
+}
 
-	if (!(a = archive_read_new())) goto bad_archive;
-	archive_read_support_filter_all(a);
-	archive_read_support_format_all(a);
-	for (retry = 0; retry <= RETRY_ARCHIVE_COUNT; ++retry) {
-		open_ret = archive_read_open_filename(a, filename, BLOCK_SIZE);
-		if (open_ret != ARCHIVE_RETRY) break;
+/* Throttling of the reads, for scans of production hosts: -R and -F are
+ * token buckets on the bytes and files read per second, -L backs off from
+ * the reads while their average latency is above a target. The state is
+ * in shared memory, as the sandbox processes read files too. Each bucket
+ * is a virtual clock: an amount moves it forward by amount / rate, and
+ * the reader waits for it when it is more than THROTTLE_BURST ahead. */
+struct throttle {
+	unsigned long long bytes_clock;
+	unsigned long long files_clock;
+	unsigned long long latency;
+	unsigned long long delay;
+};
+
+static struct throttle *throttle = NULL;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_ns(unsigned long long ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR) ;
+}
+
+static void throttle_wait(unsigned long long *clock, unsigned long long amount,
+                          unsigned long long rate)
+{
+	unsigned long long now = now_ns();
+	unsigned long long old = __atomic_load_n(clock, __ATOMIC_RELAXED);
+	unsigned long long next;
+
+	do {
+		next = (old > now ? old : now) + amount * 1000000000ull / rate;
+	} while (!__atomic_compare_exchange_n(clock, &old, next, 0,
+	                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	if (next > now + THROTTLE_BURST) sleep_ns(next - now - THROTTLE_BURST);
+}
+
+static void throttle_init(void)
+{
+	if (!option_rate && !option_file_rate && !option_latency) return;
+	throttle = (struct throttle *)mmap(NULL, sizeof (struct throttle),
+	                                   PROT_READ | PROT_WRITE,
+	                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (throttle == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
 	}
-	if (open_ret != ARCHIVE_OK && open_ret != ARCHIVE_WARN) goto bad_archive2;
-	if (!(buf = malloc(BLOCK_SIZE))) goto bad_archive2;
-	for (;;) {
-		MD5_CTX c;
-		unsigned long long fsize = 0;
-		unsigned char md5_out[MD5_DIGEST_LENGTH];
-		const char *entry_pathname;
-		char *escaped_entry_pathname;
-		char xerror[MD5_DIGEST_LENGTH * 2 + 1];
-		int md5_error = 0;
-
-		for (retry = 0; retry <= RETRY_ARCHIVE_COUNT; ++retry) {
-			rh_ret = archive_read_next_header(a, &entry);
-			if (rh_ret != ARCHIVE_RETRY) break;
-		}
-		if (rh_ret == ARCHIVE_FATAL) goto bad_archive2;
-		if (rh_ret != ARCHIVE_OK && rh_ret != ARCHIVE_WARN) break;
-		fsize = 0;
-		if (MD5_Init(&c) != 1) goto bad_archive2;
-		while (1) {
-			int size;
-			for (retry = 0; retry <= RETRY_ARCHIVE_COUNT; ++retry) {
-				size = archive_read_data(a, buf, BLOCK_SIZE);
-				if (size != ARCHIVE_RETRY) break;
-			}
-			if (size < 0) {
-				if (size == ARCHIVE_FATAL) {
-					MD5_Final(md5_out, &c);
-					goto bad_archive2;
-				}
-				md5_error = 1;
-				set_xerror(xerror, sizeof(xerror),
-				           "bad afile", archive_error_string(a));
-				break;
-			} else if (size == 0) {
-				break;
-			} else {
-				if (MD5_Update(&c, buf, size) != 1) {
-					md5_error = 1;
-					set_xerror(xerror, sizeof(xerror),
-					           "bad afile", archive_error_string(a));
-					break;
-				}
-				fsize += size;
-			}
-		}
-		if (MD5_Final(md5_out, &c) != 1) goto bad_archive2;
-
-		if ((size_t)(flist_p - flist) >= flist_alloc_size) {
-			char **t;
-			flist_alloc_size = grow_size(flist_alloc_size);
-			t = (char **)realloc(flist, flist_alloc_size * sizeof (char *));
-			if (!t) goto bad_archive2;
-			flist_p = t + (flist_p - flist);
-			flist = t;
-		}
-		entry_pathname = archive_entry_pathname(entry);
-		if (!entry_pathname) {
-			++name_error_counter;
-			escaped_entry_pathname = malloc(256);
-			if (escaped_entry_pathname) {
-				sprintf(escaped_entry_pathname, "%%#0;BAD_NAME_%llu", name_error_counter);
-			} else {
-				entry_pathname = "%#0;";
-				escaped_entry_pathname = (char *)entry_pathname;
-			}
-		} else {
-			escaped_entry_pathname = escape_filename(entry_pathname);
-		}
-		*flist_p = (char *)
-			malloc(MD5_DIGEST_LENGTH * 2 + 2 +
-			       33 + strlen(escaped_entry_pathname) +
-			       5 + strlen(escaped_filename) + 1);
-		if (!*flist_p) goto bad_archive2;
-		if (md5_error) {
-			sprintf(*flist_p, "%s  %15llu %s%%%%%%%%/%s",
-			        xerror, 0ull, escaped_filename, escaped_entry_pathname);
-		} else {
-			for (j = 0; j < MD5_DIGEST_LENGTH; ++j) {
-				sprintf(*flist_p + 2 * j, "%02x", md5_out[j]);
-			}
-			sprintf(*flist_p + 2 * MD5_DIGEST_LENGTH, "  %15llu %s%%%%%%%%/%s",
-			        fsize, escaped_filename, escaped_entry_pathname);
-		}
-		++flist_p;
-		if (entry_pathname != escaped_entry_pathname) {
-			free(escaped_entry_pathname);
-		}
+	memset(throttle, 0, sizeof (struct throttle));
+}
+
+/* before opening a file to read */
+static void throttle_file(void)
+{
+	if (throttle && option_file_rate) throttle_wait(&throttle->files_clock, 1, option_file_rate);
+}
+
+/* before reading size bytes, the start time of the read for throttle_read_end */
+static unsigned long long throttle_read(size_t size)
+{
+	unsigned long long delay;
+
+	if (!throttle) return 0;
+	if (option_rate) throttle_wait(&throttle->bytes_clock, size, option_rate);
+	if (!option_latency) return 0;
+	if ((delay = __atomic_load_n(&throttle->delay, __ATOMIC_RELAXED))) sleep_ns(delay);
+	return now_ns();
+}
+
+/* the delay before each read doubles while the average latency is above
+ * the target, and halves when it is back below */
+static void throttle_read_end(unsigned long long start)
+{
+	unsigned long long latency, delay;
+
+	if (!throttle || !option_latency) return;
+	latency = __atomic_load_n(&throttle->latency, __ATOMIC_RELAXED);
+	latency = latency - latency / 8 + (now_ns() - start) / 8;
+	__atomic_store_n(&throttle->latency, latency, __ATOMIC_RELAXED);
+	delay = __atomic_load_n(&throttle->delay, __ATOMIC_RELAXED);
+	if (latency > option_latency) {
+		delay = delay < BACKOFF_MIN ? BACKOFF_MIN : delay * 2;
+		if (delay > BACKOFF_MAX) delay = BACKOFF_MAX;
+	} else {
+		delay = delay / 2 < BACKOFF_MIN ? 0 : delay / 2;
 	}
-	free(buf);
-	buf = NULL;
+	__atomic_store_n(&throttle->delay, delay, __ATOMIC_RELAXED);
+}
 
-	if (rh_ret != ARCHIVE_EOF) goto bad_archive2;
-	if (archive_read_free(a) != ARCHIVE_OK) goto bad_archive;
+#ifndef IOPRIO_CLASS_SHIFT
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#endif
 
-	if (flist) {
-		qsort(flist, flist_p - flist, sizeof (char **), sort_str_with_xmd5);
-		for (p = flist; p < flist_p; ++p) {
-			printf("%s\n", *p);
-			free(*p);
-		}
-		free(flist);
+/* -P idle, be or be:level, 0 when invalid */
+static int parse_ioprio(const char *s)
+{
+	char *end;
+	unsigned long level = 4;
+
+	if (strcmp(s, "idle") == 0) return IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+	if (strncmp(s, "be", 2) != 0) return 0;
+	if (s[2] == ':') {
+		level = strtoul(s + 3, &end, 10);
+		if (end == s + 3 || *end || level > 7) return 0;
+	} else if (s[2]) {
+		return 0;
 	}
+	return IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | level;
+}
 
-	return 0;
-bad_archive2:
-	archive_read_free(a);
-bad_archive:
-	for (p = flist; p < flist_p; ++p) free(*p);
-	free(flist);
-	free(buf);
-	return -1;
+/* the decimal number of option opt, exits unless it is from min to max */
+static unsigned long long parse_count(int opt, const char *s,
+                                      unsigned long long min, unsigned long long max)
+{
+	char *end;
+	unsigned long long v;
+
+	errno = 0;
+	v = strtoull(s, &end, 10);
+	if (*s < '0' || *s > '9' || *end || errno || v < min || v > max) {
+		fprintf(stderr, "%s: invalid -%c, a number from %llu to %llu\n", s, opt, min, max);
+		exit(EXIT_FAILURE);
+	}
+	return v;
 }
 
-int do_xmd5_file(const char *filename,
-                 const char *escaped_filename,
-                 unsigned long long stat_size)
-{
-	FILE    *f;
-	size_t  rsize;
-	MD5_CTX c;
-	unsigned long long fsize = 0;
-	unsigned char md5_out[MD5_DIGEST_LENGTH];
-	void *buf = NULL;
-	int j;
+/* bytes with an optional k, m or g suffix, 0 when invalid */
+static unsigned long long parse_rate(const char *s)
+{
+	char *end;
+	unsigned long long v;
+	unsigned shift = 0;
 
-	f = fopen(filename, "rb");
-	if (!f) goto bad_file_errno;
-	if (MD5_Init(&c) != 1) goto bad_file2_md5;
-	if (!(buf = malloc(BLOCK_SIZE))) goto bad_file2_errno;
-	while ((rsize = fread(buf, 1, BLOCK_SIZE, f))) {
-		if (MD5_Update(&c, buf, rsize) != 1) {
-			MD5_Final(md5_out, &c);
-			free(buf);
-			goto bad_file2_md5;
-		}
-		fsize += rsize;
+	if (*s < '0' || *s > '9') return 0;
+	errno = 0;
+	v = strtoull(s, &end, 10);
+	if (errno) return 0;
+	switch (*end) {
+	case 'g': case 'G':
+		shift += 10;
+		/* fall through */
+	case 'm': case 'M':
+		shift += 10;
+		/* fall through */
+	case 'k': case 'K':
+		shift += 10;
+		++end;
 	}
-	free(buf);
-	if (MD5_Final(md5_out, &c) != 1) goto bad_file2_md5;
-	if (ferror(f)) goto bad_file2_ferror;
+	if (*end || v > ~0ull >> shift) return 0;
+	return v << shift;
+}
 
-	if (fclose(f) != 0) goto bad_file_errno;
-	if (stat_size != UNKNOWN_SIZE && stat_size != fsize) goto bad_file_size;
-	for (j = 0; j < MD5_DIGEST_LENGTH; ++j) {
-		printf("%02x", md5_out[j]);
+/* Progress statistics, reported on SIGUSR1 and with -S or -T. The
+ * counters are in shared memory, as the sandbox processes read and list
+ * files too. Each thread charges the time between two calls of
+ * stats_phase to the phase it was in, the split is in thread time. */
+enum {
+	PHASE_NONE,
+	PHASE_STAT,
+	PHASE_READ,
+	PHASE_HASH,
+	PHASE_ARCHIVE,
+	PHASE_COUNT
+};
+
+struct stats {
+	unsigned long long entries;
+	unsigned long long files;
+	unsigned long long bytes;
+	unsigned long long members;
+	unsigned long long member_bytes;
+	unsigned long long phase_ns[PHASE_COUNT];
+	/* the files hashed or found in the cache, against the totals of -E */
+	unsigned long long done_files;
+	unsigned long long done_bytes;
+	unsigned long long total_files;
+	unsigned long long total_bytes;
+};
+
+static struct stats *stats = NULL;
+static __thread int cur_phase = PHASE_NONE;
+static __thread unsigned long long phase_start = 0;
+
+static void stats_init(void)
+{
+	stats = (struct stats *)mmap(NULL, sizeof (struct stats), PROT_READ | PROT_WRITE,
+	                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
 	}
-	printf("  %15llu %s\n", fsize, escaped_filename);
+	memset(stats, 0, sizeof (struct stats));
+}
 
-	return 0;
-bad_file2_errno:
-	print_error_line("bad file", strerror(errno), escaped_filename);
-	goto file_error2;
-bad_file2_md5:
-	print_error_line("bad file", "checksum", escaped_filename);
-	goto file_error2;
-bad_file2_ferror:
-	print_error_line("bad file", "ferror", escaped_filename);
-	goto file_error2;
-bad_file_errno:
-	print_error_line("bad file", strerror(errno), escaped_filename);
-	goto file_error;
-bad_file_size:
-	print_error_line("bad file", "size", escaped_filename);
-	goto file_error;
-file_error2:
-	fclose(f);
-file_error:
-	return -1;
+static void stats_add(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
 }
 
-int do_xmd5(const char *filename);
+/* enter phase, returns the phase to go back to */
+static int stats_phase(int phase)
+{
+	int old = cur_phase;
+	unsigned long long now = now_ns();
 
-int sort_str(const void *a, const void *b)
+	if (old != PHASE_NONE) stats_add(&stats->phase_ns[old], now - phase_start);
+	cur_phase = phase;
+	phase_start = now;
+	return old;
+}
+
+/* Kernel hashing (-k): the data of a file is spliced from the page cache
+ * through a pipe into an AF_ALG hash socket, and never copied to user
+ * space. Each thread binds a socket to the hash and has its pipe, each
+ * file is hashed on a socket of its own accepted from it. What was read
+ * anyway, by libarchive or from a file that cannot be spliced, is sent.
+ * Without AF_ALG, files are hashed by the read path. */
+static int alg_disabled = 0;
+static __thread int alg_sock = -1;
+static __thread int alg_pipe[2] = { -1, -1 };
+
+static void alg_close_pipe(void)
 {
-	return strcmp(*(char * const *)a, *(char * const *)b);
+	if (alg_pipe[0] >= 0) close(alg_pipe[0]);
+	if (alg_pipe[1] >= 0) close(alg_pipe[1]);
+	alg_pipe[0] = alg_pipe[1] = -1;
 }
 
-int do_xmd5_dir(const char *filename, const char *escaped_filename)
+/* socket to hash a file on, -1 for the read path */
+static int alg_open(void)
 {
-	DIR *dir;
-	size_t filename_len = strlen(filename);
-	struct dirent *dir_entry;
-	char **flist = NULL;
-	char **flist_p = NULL;
-	size_t flist_alloc_size = 0;
-	char **p;
-
-	if (!(dir = opendir(filename))) goto bad_dir_errno;
-	while (1) {
-		errno = 0;
-		dir_entry = readdir(dir);
-		if (errno) goto bad_dir2_errno;
-		if (!dir_entry) break;
-		if (strcmp(dir_entry->d_name, ".") != 0 &&
-		    strcmp(dir_entry->d_name, "..") != 0) {
-			size_t fname_len = strlen(dir_entry->d_name);
-			if ((size_t)(flist_p - flist) >= flist_alloc_size) {
-				char **t;
-				flist_alloc_size = grow_size(flist_alloc_size);
-				t = (char **)realloc(flist, flist_alloc_size * sizeof (char *));
-				if (!t) goto bad_dir2_errno;
-				flist_p = t + (flist_p - flist);
-				flist = t;
-			}
-			*flist_p = (char *)malloc(filename_len + 1 + fname_len + 1);
-			if (!*flist_p) goto bad_dir2_errno;
-			memcpy(*flist_p, filename, filename_len);
-			(*flist_p)[filename_len] = '/';
-			memcpy(*flist_p + filename_len + 1,
-			       dir_entry->d_name, fname_len + 1);
-			++flist_p;
-		}
-	}
-	if (closedir(dir) != 0) goto bad_dir_errno;
+	struct sockaddr_alg sa;
+	int fd;
 
-	if (flist) {
-		qsort(flist, flist_p - flist, sizeof (char **), sort_str);
-		for (p = flist; p < flist_p; ++p) {
-			do_xmd5(*p);
-			free(*p);
-		}
-		free(flist);
+	if (!option_kernel_hash || __atomic_load_n(&alg_disabled, __ATOMIC_RELAXED)) return -1;
+	if (alg_sock < 0) {
+		memset(&sa, 0, sizeof (sa));
+		sa.salg_family = AF_ALG;
+		strcpy((char *)sa.salg_type, "hash");
+		strcpy((char *)sa.salg_name, hash_algos[option_hash].alg);
+		if ((alg_sock = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) goto error;
+		if (bind(alg_sock, (struct sockaddr *)&sa, sizeof (sa)) != 0) goto error;
+	}
+	if (alg_pipe[0] < 0) {
+		if (pipe2(alg_pipe, O_CLOEXEC) != 0) goto error;
+		/* a read at a time, if allowed */
+		fcntl(alg_pipe[1], F_SETPIPE_SZ, option_read_size);
 	}
+	if ((fd = accept4(alg_sock, NULL, NULL, SOCK_CLOEXEC)) < 0) goto error;
+	return fd;
+error:
+	if (!__atomic_exchange_n(&alg_disabled, 1, __ATOMIC_RELAXED)) {
+		fprintf(stderr, "AF_ALG %s: %s, using the read path\n",
+		        hash_algos[option_hash].alg, strerror(errno));
+	}
+	if (alg_sock >= 0) close(alg_sock);
+	alg_sock = -1;
+	alg_close_pipe();
+	return -1;
+}
+
+static int alg_send(int fd, const void *data, size_t size)
+{
+	const char *p = (const char *)data;
+	ssize_t wsize;
 
+	while (size > 0) {
+		wsize = send(fd, p, size, MSG_MORE | MSG_NOSIGNAL);
+		if (wsize < 0 && errno == EINTR) continue;
+		if (wsize <= 0) return -1;
+		p += wsize;
+		size -= wsize;
+	}
 	return 0;
-bad_dir2_errno:
-	print_error_line("bad dir", strerror(errno), escaped_filename);
-	goto dir_error2;
-bad_dir_errno:
-	print_error_line("bad dir", strerror(errno), escaped_filename);
-	goto dir_error;
-dir_error2:
-	for (p = flist; p < flist_p; ++p) free(*p);
-	closedir(dir);
-dir_error:
-	free(flist);
-	return -1;
 }
 
-int do_xmd5(const char *filename)
+/* move size bytes from the pipe to the socket fd */
+static int alg_splice(int fd, size_t size)
 {
-	struct stat st;
-	char *escaped_filename = escape_filename(filename);
-	int ret = -1;
+	ssize_t n;
 
-	if (!escaped_filename) {
-		print_error_line("escape name fail", strerror(errno), "???");
-		return -1;
+	while (size > 0) {
+		n = splice(alg_pipe[0], NULL, fd, NULL, size, SPLICE_F_MORE);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			/* the data left in the pipe is of no use */
+			alg_close_pipe();
+			return -1;
+		}
+		size -= n;
 	}
+	return 0;
+}
 
-	if (lstat(filename, &st) != 0) {
-		print_error_line("stat fail", strerror(errno), escaped_filename);
-		if (filename != escaped_filename) free(escaped_filename);
-		return -1;
+static int alg_final(int fd, unsigned char *digest)
+{
+	size_t len = hash_algos[option_hash].digest_length;
+	ssize_t rsize;
+
+	/* the end of the data */
+	while (send(fd, NULL, 0, MSG_NOSIGNAL) < 0) {
+		if (errno != EINTR) return -1;
 	}
+	do {
+		rsize = read(fd, digest, len);
+	} while (rsize < 0 && errno == EINTR);
+	return rsize == (ssize_t)len ? 0 : -1;
+}
 
-	if (S_ISREG(st.st_mode)) {
-		if (do_xmd5_file(filename, escaped_filename, st.st_size) == 0) {
-#ifndef NO_ARCHIVES
-#ifdef DO_FORK
-			pid_t pid;
-			fflush(stdout);
-			fflush(stderr);
-			pid = fork();
-			if (pid == 0) {
-				do_xmd5_archive(filename, escaped_filename);
-				exit(0);
-			} else if (pid != -1) {
-				waitpid(pid, NULL, 0);
-			}
-#else
-			do_xmd5_archive(filename, escaped_filename);
-#endif
-#endif
-			ret = 0;
-		} else {
-			ret = -1;
+/* -N: the pages of a file are dropped from the page cache as they are
+ * hashed, as POSIX_FADV_NOREUSE does nothing for read() on current
+ * kernels. A file that is all cached when it is opened is left there, it
+ * belongs to the working set of the host; this is decided once, before
+ * the readahead of xmd5 caches it. The first SNIFF_SIZE bytes may have
+ * been read by xmd5 itself to sniff the file, they are not counted. */
+static int map_cached(const char *addr, size_t len)
+{
+	unsigned char vec[256];
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t skip = (unsigned long)addr & (page - 1);
+	size_t i, n, k;
+
+	addr -= skip;
+	len += skip;
+	for (i = 0; i < len; i += n * page) {
+		n = (len - i + page - 1) / page;
+		if (n > sizeof (vec)) n = sizeof (vec);
+		if (mincore((void *)(addr + i), n * page, vec) != 0) return 0;
+		for (k = 0; k < n; ++k) {
+			if (!(vec[k] & 1)) return 0;
 		}
-	} else if (S_ISDIR(st.st_mode)) {
-		ret = do_xmd5_dir(filename, escaped_filename);
-	} else if (S_ISLNK(st.st_mode)) {
-		print_error_line("file type", "link", escaped_filename);
-		ret = -1;
-	} else if (S_ISCHR(st.st_mode)) {
-		print_error_line("file type", "char device", escaped_filename);
-		ret = -1;
-	} else if (S_ISBLK(st.st_mode)) {
-		print_error_line("file type", "block device", escaped_filename);
-		ret = -1;
-	} else if (S_ISFIFO(st.st_mode)) {
-		print_error_line("file type", "fifo", escaped_filename);
-		ret = -1;
-	} else if (S_ISSOCK(st.st_mode)) {
-		print_error_line("file type", "socket", escaped_filename);
-		ret = -1;
-	} else {
-		print_error_line("file type", "unknown", escaped_filename);
-		ret = -1;
 	}
+	return 1;
+}
 
-	if (filename != escaped_filename) free(escaped_filename);
+/* 1 if the file fd of size bytes is to be left in the page cache */
+static int noreuse_keep(int fd, unsigned long long size)
+{
+	char *map;
+	int ret;
+
+	if (!option_noreuse) return 1;
+	if (size <= SNIFF_SIZE || size != (size_t)size) return 0;
+	map = (char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) return 0;
+	ret = map_cached(map + SNIFF_SIZE, size - SNIFF_SIZE);
+	munmap(map, size);
 	return ret;
 }
 
-int main(int argc, char* argv[])
+/* the folios of the page cache are only dropped once the whole of them
+ * is, and readahead makes them larger than a read; the range is extended
+ * back to the start of a PMD so they are once the next ranges are read */
+#define NOREUSE_ALIGN (2ULL << 20)
+
+static void noreuse_drop(int fd, unsigned long long off, size_t len, int keep)
 {
-	int i;
+	unsigned long long start = off & ~(NOREUSE_ALIGN - 1);
 
-#ifdef DO_MTRACE
-	mtrace();
-#endif
-	for (i = 1; i < argc; ++i) {
-		do_xmd5(argv[i]);
+	if (!keep) posix_fadvise(fd, start, off + len - start, POSIX_FADV_DONTNEED);
+}
+
+/* A regular file being hashed. libarchive reads it through xfile_read, and
+ * the bytes it reads in order are hashed on the way, so that an archive is
+ * hashed and listed from a single read of the file. With -k, alg is the
+ * socket the file is hashed on. */
+struct xfile {
+	int fd;
+	struct xhash hash;
+	int alg;
+	int no_splice;
+	unsigned long long size;
+	unsigned long long pos;
+	unsigned long long hash_pos;
+	void *buf;
+	int error;
+	/* -N leaves the file in the page cache */
+	int keep;
+};
+
+#define XFILE_EREAD 1
+#define XFILE_EHASH 2
+
+/* a file mapped by -m can shrink under us: the SIGBUS is turned into a
+ * read error of the file being hashed */
+static __thread sigjmp_buf mmap_jmp;
+static __thread volatile sig_atomic_t mmap_jmp_set = 0;
+
+static void mmap_sigbus(int sig)
+{
+	if (mmap_jmp_set) siglongjmp(mmap_jmp, 1);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static int xfile_hash(struct xfile *xf, const void *data, size_t size)
+{
+	int phase = stats_phase(PHASE_HASH);
+	int ret = xf->alg >= 0 ? alg_send(xf->alg, data, size) :
+	                         xhash_update(&xf->hash, data, size);
+
+	stats_phase(phase);
+	if (ret != 0) {
+		xf->error = XFILE_EHASH;
+		return -1;
+	}
+	xf->hash_pos += size;
+	return 0;
+}
+
+/* hash from hash_pos up to end, at most up to the size from fstat, from
+ * a mapping of the file; 1 when it cannot be mapped */
+static int xfile_hash_mmap(struct xfile *xf, unsigned long long end)
+{
+	unsigned long long start = xf->hash_pos & ~(unsigned long long)(sysconf(_SC_PAGESIZE) - 1);
+	size_t len;
+	char *map;
+
+	if (end > xf->size) end = xf->size;
+	len = end - start;
+	map = (char *)mmap(NULL, len, PROT_READ, MAP_SHARED, xf->fd, start);
+	if (map == MAP_FAILED) return 1;
+	madvise(map, len, MADV_SEQUENTIAL);
+	if (sigsetjmp(mmap_jmp, 1) == 0) {
+		mmap_jmp_set = 1;
+		while (xf->hash_pos < end) {
+			size_t size = option_read_size;
+			unsigned long long off = xf->hash_pos;
+			char *p = map + (off - start);
+
+			if (end - off < size) size = end - off;
+			throttle_read(size);
+			stats_add(&stats->bytes, size);
+			if (xfile_hash(xf, p, size) != 0) break;
+			if (!xf->keep) {
+				/* mapped pages are not dropped */
+				size_t skip = (unsigned long)p & (sysconf(_SC_PAGESIZE) - 1);
+				madvise(p - skip, size + skip, MADV_DONTNEED);
+				noreuse_drop(xf->fd, off, size, 0);
+			}
+		}
+	} else {
+		xf->error = XFILE_EREAD;
+	}
+	mmap_jmp_set = 0;
+	munmap(map, len);
+	return xf->error ? -1 : 0;
+}
+
+/* hash from hash_pos up to end with -k, 1 when the file cannot be spliced */
+static int xfile_splice_to(struct xfile *xf, unsigned long long end)
+{
+	while (xf->hash_pos < end) {
+		size_t size = option_read_size;
+		loff_t off = xf->hash_pos;
+		unsigned long long start;
+		ssize_t rsize;
+		int phase, ret;
+
+		if (end - xf->hash_pos < size) size = end - xf->hash_pos;
+		start = throttle_read(size);
+		phase = stats_phase(PHASE_READ);
+		rsize = splice(xf->fd, &off, alg_pipe[1], NULL, size, SPLICE_F_MORE);
+		stats_phase(phase);
+		throttle_read_end(start);
+		if (rsize < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EINVAL && xf->hash_pos == 0) return 1;
+			xf->error = XFILE_EREAD;
+			return -1;
+		}
+		if (rsize == 0) break;
+		stats_add(&stats->bytes, rsize);
+		phase = stats_phase(PHASE_HASH);
+		ret = alg_splice(xf->alg, rsize);
+		stats_phase(phase);
+		if (ret != 0) {
+			xf->error = XFILE_EHASH;
+			return -1;
+		}
+		noreuse_drop(xf->fd, xf->hash_pos, rsize, xf->keep);
+		xf->hash_pos += rsize;
+	}
+	return 0;
+}
+
+/* hash from hash_pos up to end, or up to the end of file */
+static int xfile_hash_to(struct xfile *xf, unsigned long long end)
+{
+	if (xf->alg >= 0 && !xf->no_splice) {
+		int ret = xfile_splice_to(xf, end);
+		if (ret <= 0) return ret;
+		xf->no_splice = 1;
+	}
+	if (option_mmap && xf->size >= MMAP_MIN_SIZE &&
+	    xf->hash_pos < xf->size && xf->hash_pos < end) {
+		if (xfile_hash_mmap(xf, end) < 0) return -1;
+	}
+	while (xf->hash_pos < end) {
+		size_t size = option_read_size;
+		unsigned long long start;
+		ssize_t rsize;
+		int phase;
+
+		if (end - xf->hash_pos < size) size = end - xf->hash_pos;
+		start = throttle_read(size);
+		phase = stats_phase(PHASE_READ);
+		rsize = pread(xf->fd, xf->buf, size, xf->hash_pos);
+		stats_phase(phase);
+		throttle_read_end(start);
+		if (rsize < 0) {
+			if (errno == EINTR) continue;
+			xf->error = XFILE_EREAD;
+			return -1;
+		}
+		if (rsize == 0) break;
+		stats_add(&stats->bytes, rsize);
+		/* get the next buffer read in while this one is hashed */
+		if ((size_t)rsize == size && end - xf->hash_pos > size) {
+			posix_fadvise(xf->fd, xf->hash_pos + size, option_read_size, POSIX_FADV_WILLNEED);
+		}
+		noreuse_drop(xf->fd, xf->hash_pos, rsize, xf->keep);
+		if (xfile_hash(xf, xf->buf, rsize) != 0) return -1;
+	}
+	return 0;
+}
+
+static la_ssize_t xfile_read(struct archive *a, void *client_data,
+                             const void **buffer)
+{
+	struct xfile *xf = (struct xfile *)client_data;
+	unsigned long long start;
+	ssize_t rsize;
+	int phase;
+
+	if (xf->error) return ARCHIVE_FATAL;
+	/* a short skip forward is cheaper to read than to come back for */
+	if (xf->pos > xf->hash_pos && xf->pos - xf->hash_pos <= HASH_GAP_SIZE) {
+		if (xfile_hash_to(xf, xf->pos) != 0) return ARCHIVE_FATAL;
+	}
+	do {
+		start = throttle_read(option_read_size);
+		phase = stats_phase(PHASE_READ);
+		rsize = pread(xf->fd, xf->buf, option_read_size, xf->pos);
+		stats_phase(phase);
+		throttle_read_end(start);
+	} while (rsize < 0 && errno == EINTR);
+	if (rsize < 0) {
+		archive_set_error(a, errno, "read error");
+		xf->error = XFILE_EREAD;
+		return ARCHIVE_FATAL;
+	}
+	stats_add(&stats->bytes, rsize);
+	/* the data is in the buffer now */
+	noreuse_drop(xf->fd, xf->pos, rsize, xf->keep);
+	if (xf->pos <= xf->hash_pos && xf->pos + rsize > xf->hash_pos) {
+		size_t skip = xf->hash_pos - xf->pos;
+		if (xfile_hash(xf, (char *)xf->buf + skip, rsize - skip) != 0) {
+			return ARCHIVE_FATAL;
+		}
+	}
+	xf->pos += rsize;
+	*buffer = xf->buf;
+	return rsize;
+}
+
+static la_int64_t xfile_seek(struct archive *a, void *client_data,
+                             la_int64_t offset, int whence)
+{
+	struct xfile *xf = (struct xfile *)client_data;
+	la_int64_t new_pos;
+
+	(void)a;
+	switch (whence) {
+	case SEEK_SET:
+		new_pos = offset;
+		break;
+	case SEEK_CUR:
+		new_pos = xf->pos + offset;
+		break;
+	case SEEK_END:
+		new_pos = xf->size + offset;
+		break;
+	default:
+		return ARCHIVE_FATAL;
+	}
+	if (new_pos < 0) return ARCHIVE_FATAL;
+	xf->pos = new_pos;
+	return new_pos;
+}
+
+/* Lines of an archive listing, without the archive name, to be sorted.
+ * Past option_sort_memory bytes they are sorted and written to a
+ * temporary file, and the runs are merged at the end, into another
+ * temporary file that is copied to the output when its turn comes. Past
+ * MAX_RUNS runs, they are merged into one first. */
+struct listing {
+	char **lines;
+	size_t count;
+	size_t alloc;
+	size_t mem;
+	FILE **runs;
+	size_t run_count;
+	int no_spill;
+};
+
+/* a merge source: a run or the lines left in memory */
+struct listing_source {
+	FILE *f;
+	char *line;
+	size_t line_alloc;
+	char **next;
+	char **end;
+};
+
+static FILE *open_tmp_file(void)
+{
+	const char *dir = getenv("TMPDIR");
+	char *name;
+	FILE *f = NULL;
+	int fd;
+
+	if (!dir || !*dir) dir = "/tmp";
+	if (!(name = (char *)malloc(strlen(dir) + 14))) return NULL;
+	sprintf(name, "%s/xmd5.XXXXXX", dir);
+	if ((fd = mkostemp(name, O_CLOEXEC)) >= 0) {
+		unlink(name);
+		if (!(f = fdopen(fd, "w+"))) close(fd);
+	}
+	free(name);
+	return f;
+}
+
+/* the next line of s, NULL at its end */
+static const char *source_line(struct listing_source *s)
+{
+	ssize_t len;
+
+	if (!s->f) return s->next < s->end ? *s->next : NULL;
+	if ((len = getline(&s->line, &s->line_alloc, s->f)) <= 0) return NULL;
+	if (s->line[len - 1] == '\n') s->line[len - 1] = '\0';
+	return s->line;
+}
+
+static void print_listing_line(const char *line, const char *escaped_filename,
+                               struct xbuf *out)
+{
+	const char *name = get_name_field(line);
+
+	xbuf_printf(out, "%.*s%s%%%%%%%%/%s\n", (int)(name - line), line,
+	            escaped_filename, name);
+}
+
+/* merge the runs of l and its lines in memory, sorted, into out, or into
+ * f through out if f is set; the lines get escaped_filename and the
+ * marker in front of their names if it is set */
+static int listing_merge(struct listing *l, const char *escaped_filename,
+                         struct xbuf *out, FILE *f)
+{
+	struct listing_source *sources;
+	struct listing_source **heap;
+	const char **cur;
+	size_t count = l->run_count + 1;
+	size_t heap_count = 0;
+	size_t i, k, c;
+	int ret = 0;
+
+	sources = (struct listing_source *)calloc(count, sizeof (struct listing_source));
+	heap = (struct listing_source **)malloc(count * sizeof (struct listing_source *));
+	cur = (const char **)malloc(count * sizeof (const char *));
+	if (!sources || !heap || !cur) {
+		ret = -1;
+		goto end;
+	}
+	for (i = 0; i < l->run_count; ++i) sources[i].f = l->runs[i];
+	sources[i].next = l->lines;
+	sources[i].end = l->lines + l->count;
+	/* a binary heap of the sources by their current line */
+	for (i = 0; i < count; ++i) {
+		if (!(cur[i] = source_line(&sources[i]))) continue;
+		for (k = heap_count++; k > 0; k = (k - 1) / 2) {
+			if (cmp_str_with_xmd5(cur[heap[(k - 1) / 2] - sources], cur[i]) <= 0) break;
+			heap[k] = heap[(k - 1) / 2];
+		}
+		heap[k] = &sources[i];
+	}
+	while (heap_count) {
+		struct listing_source *s = heap[0];
+
+		i = s - sources;
+		if (escaped_filename) {
+			print_listing_line(cur[i], escaped_filename, out);
+		} else {
+			xbuf_printf(out, "%s\n", cur[i]);
+		}
+		if (f && out->len >= READ_SIZE) {
+			if (fwrite(out->data, 1, out->len, f) != out->len) ret = -1;
+			out->len = 0;
+		}
+		if (!s->f) ++s->next;
+		if (!(cur[i] = source_line(s))) {
+			if (s->f && ferror(s->f)) ret = -1;
+			s = heap[--heap_count];
+			i = s - sources;
+		}
+		for (k = 0; (c = 2 * k + 1) < heap_count; k = c) {
+			if (c + 1 < heap_count &&
+			    cmp_str_with_xmd5(cur[heap[c + 1] - sources], cur[heap[c] - sources]) < 0) ++c;
+			if (cmp_str_with_xmd5(cur[i], cur[heap[c] - sources]) <= 0) break;
+			heap[k] = heap[c];
+		}
+		heap[k] = s;
+	}
+	if (f) {
+		if (fwrite(out->data, 1, out->len, f) != out->len) ret = -1;
+		out->len = 0;
+		if (fflush(f) != 0 || ferror(f)) ret = -1;
+	}
+end:
+	for (i = 0; sources && i < count; ++i) free(sources[i].line);
+	free(sources);
+	free(heap);
+	free(cur);
+	return ret;
+}
+
+/* merge the runs into one, so that a small -M does not run out of files */
+static int listing_merge_runs(struct listing *l)
+{
+	struct xbuf buf = { NULL, 0, 0 };
+	size_t count = l->count;
+	size_t i;
+	FILE *f;
+	int ret;
+
+	if (!(f = open_tmp_file())) return 0;
+	/* only the runs */
+	l->count = 0;
+	ret = listing_merge(l, NULL, &buf, f);
+	l->count = count;
+	xbuf_free(&buf);
+	if (ret != 0 || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return -1;
+	}
+	for (i = 0; i < l->run_count; ++i) fclose(l->runs[i]);
+	l->runs[0] = f;
+	l->run_count = 1;
+	return 0;
+}
+
+/* write the lines in memory as a sorted run, 0 if they stay in memory */
+static int listing_spill(struct listing *l)
+{
+	FILE *f, **t;
+	size_t i;
+
+	if (l->no_spill) return 0;
+	if (l->run_count >= MAX_RUNS && listing_merge_runs(l) != 0) return -1;
+	if (!(t = (FILE **)realloc(l->runs, (l->run_count + 1) * sizeof (FILE *))) ||
+	    !(l->runs = t, f = open_tmp_file())) {
+		/* go on in memory */
+		l->no_spill = 1;
+		return 0;
+	}
+	qsort(l->lines, l->count, sizeof (char *), sort_str_with_xmd5);
+	for (i = 0; i < l->count; ++i) {
+		fputs(l->lines[i], f);
+		putc('\n', f);
+	}
+	if (fflush(f) != 0 || ferror(f) || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return -1;
+	}
+	for (i = 0; i < l->count; ++i) free(l->lines[i]);
+	l->runs[l->run_count++] = f;
+	l->count = 0;
+	l->mem = 0;
+	return 0;
+}
+
+static int listing_add(struct listing *l, char *line)
+{
+	if (l->count >= l->alloc) {
+		size_t alloc = grow_size(l->alloc);
+		char **t = (char **)realloc(l->lines, alloc * sizeof (char *));
+		if (!t) return -1;
+		l->lines = t;
+		l->alloc = alloc;
+	}
+	l->lines[l->count++] = line;
+	/* with the malloc overhead */
+	l->mem += strlen(line) + 1 + sizeof (char *) + 16;
+	if (l->mem > option_sort_memory) return listing_spill(l);
+	return 0;
+}
+
+static void listing_free(struct listing *l)
+{
+	size_t i;
+
+	for (i = 0; i < l->count; ++i) free(l->lines[i]);
+	for (i = 0; i < l->run_count; ++i) fclose(l->runs[i]);
+	free(l->lines);
+	free(l->runs);
+	memset(l, 0, sizeof (*l));
+}
+
+/* write the sorted lines to out; a listing that spilled is merged into a
+ * temporary file returned in spill instead, if spill is set */
+static int listing_output(struct listing *l, const char *escaped_filename,
+                          struct xbuf *out, FILE **spill)
+{
+	struct xbuf buf = { NULL, 0, 0 };
+	size_t i;
+	FILE *f;
+	int ret;
+
+	qsort(l->lines, l->count, sizeof (char *), sort_str_with_xmd5);
+	if (!l->run_count) {
+		for (i = 0; i < l->count; ++i) print_listing_line(l->lines[i], escaped_filename, out);
+		return 0;
+	}
+	if (!spill || !(f = open_tmp_file())) return listing_merge(l, escaped_filename, out, NULL);
+	ret = listing_merge(l, escaped_filename, &buf, f);
+	xbuf_free(&buf);
+	if (ret != 0) {
+		fclose(f);
+		return -1;
+	}
+	*spill = f;
+	return 0;
+}
+
+/* Signatures of the formats and filters of libarchive, so that files
+ * that cannot be archives are not opened by it (nor, with DO_FORK, sent
+ * to the sandbox). -A tries every file, which also finds the archives
+ * known from their end, like self-extracting ones. */
+struct archive_magic {
+	size_t offset;
+	const char *magic;
+	size_t len;
+};
+
+static const struct archive_magic archive_magics[] = {
+	{ 0, "\x1f\x8b", 2 },			/* gzip */
+	{ 0, "\x1f\x9d", 2 },			/* compress */
+	{ 0, "BZh", 3 },
+	{ 0, "\xfd" "7zXZ\0", 6 },
+	{ 0, "\x5d\0\0", 3 },			/* lzma */
+	{ 0, "\x28\xb5\x2f\xfd", 4 },		/* zstd */
+	{ 0, "\x04\x22\x4d\x18", 4 },		/* lz4 */
+	{ 0, "\x02\x21\x4c\x18", 4 },		/* legacy lz4 */
+	{ 0, "LZIP", 4 },
+	{ 0, "\x89LZO\0\r\n\x1a\n", 9 },
+	{ 0, "LRZI", 4 },
+	{ 0, "GRZipII", 7 },
+	{ 0, "\xed\xab\xee\xdb", 4 },		/* rpm */
+	{ 0, "begin ", 6 },			/* uuencode */
+	{ 0, "begin-base64 ", 13 },
+	{ 0, "PK\003\004", 4 },
+	{ 0, "PK\005\006", 4 },
+	{ 0, "PK\007\010", 4 },
+	{ 0, "PK00PK", 6 },
+	{ 0, "7z\xbc\xaf\x27\x1c", 6 },
+	{ 0, "Rar!\x1a\x07", 6 },
+	{ 0, "MSCF", 4 },			/* cab */
+	{ 0, "xar!", 4 },
+	{ 0, "!<arch>\n", 8 },
+	{ 0, "WARC/", 5 },
+	{ 0, "#mtree", 6 },
+	{ 0, "070707", 6 },			/* cpio */
+	{ 0, "070701", 6 },
+	{ 0, "070702", 6 },
+	{ 0, "\xc7\x71", 2 },
+	{ 0, "\x71\xc7", 2 },
+	{ 2, "-lh", 3 },			/* lha */
+	{ 2, "-lz", 3 },
+	{ 257, "ustar", 5 },
+	{ 32769, "CD001", 5 },			/* iso9660 */
+	{ 0, NULL, 0 }
+};
+
+/* an old tar header has no magic, only a checksum */
+static int tar_header_ok(const unsigned char *p)
+{
+	unsigned long sum = 0, expected = 0;
+	int i, digits = 0;
+
+	for (i = 0; i < 512; ++i) sum += i >= 148 && i < 156 ? ' ' : p[i];
+	for (i = 148; i < 156 && p[i] == ' '; ++i);
+	for (; i < 156 && p[i] >= '0' && p[i] <= '7'; ++i, ++digits) {
+		expected = expected * 8 + p[i] - '0';
+	}
+	return digits > 0 && sum == expected;
+}
+
+/* 1 if the len first bytes of a file of size bytes may be an archive */
+int archive_sniff(const void *data, size_t len, unsigned long long size)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	const struct archive_magic *m;
+
+	/* too short a read to tell */
+	if (len < SNIFF_SIZE && len < size) return 1;
+	for (m = archive_magics; m->magic; ++m) {
+		if (m->offset + m->len <= len &&
+		    memcmp(p + m->offset, m->magic, m->len) == 0) return 1;
+	}
+	return len >= 512 && tar_header_ok(p);
+}
+
+/* read and hash the first block, 1 if the file may be an archive */
+int xfile_sniff(struct xfile *xf)
+{
+	unsigned long long start;
+	ssize_t rsize;
+	int phase;
+
+	do {
+		start = throttle_read(option_read_size);
+		phase = stats_phase(PHASE_READ);
+		rsize = pread(xf->fd, xf->buf, option_read_size, 0);
+		stats_phase(phase);
+		throttle_read_end(start);
+	} while (rsize < 0 && errno == EINTR);
+	if (rsize < 0) {
+		xf->error = XFILE_EREAD;
+		return 0;
+	}
+	stats_add(&stats->bytes, rsize);
+	if (xfile_hash(xf, xf->buf, rsize) != 0) return 0;
+	if (!archive_sniff(xf->buf, rsize, xf->size)) {
+		noreuse_drop(xf->fd, 0, rsize, xf->keep);
+		return 0;
+	}
+	/* dropped once libarchive read it again */
+	return 1;
+}
+
+/* archive_sniff() on the first bytes of fd, the hash reads them again
+ * from the page cache */
+static int fd_sniff(int fd, unsigned long long stat_size)
+{
+	unsigned char buf[SNIFF_SIZE];
+	size_t len = 0;
+	ssize_t rsize;
+
+	while (len < SNIFF_SIZE) {
+		rsize = pread(fd, buf + len, SNIFF_SIZE - len, len);
+		if (rsize < 0 && errno == EINTR) continue;
+		/* let the hash report the error */
+		if (rsize < 0) return 0;
+		if (rsize == 0) break;
+		len += rsize;
+	}
+	return archive_sniff(buf, len, stat_size);
+}
+
+static struct archive *archive_open(struct xfile *xf)
+{
+	struct archive *a;
+	int open_ret, retry;
+
+	if (!(a = archive_read_new())) return NULL;
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	archive_read_set_callback_data(a, xf);
+	archive_read_set_read_callback(a, xfile_read);
+	archive_read_set_seek_callback(a, xfile_seek);
+	xf->pos = 0;
+	for (retry = 0; retry <= RETRY_ARCHIVE_COUNT; ++retry) {
+		open_ret = archive_read_open1(a);
+		if (open_ret != ARCHIVE_RETRY) break;
+	}
+	if (open_ret != ARCHIVE_OK && open_ret != ARCHIVE_WARN) {
+		archive_read_free(a);
+		return NULL;
+	}
+	return a;
+}
+
+static int archive_next(struct archive *a, struct archive_entry **entry)
+{
+	int rh_ret, retry;
+
+	for (retry = 0; retry <= RETRY_ARCHIVE_COUNT; ++retry) {
+		rh_ret = archive_read_next_header(a, entry);
+		if (rh_ret != ARCHIVE_RETRY) break;
+	}
+	return rh_ret;
+}
+
+/* The data of the member being listed, hashed as it is read, by the
+ * listing or by a nested archive reading it. Holes of sparse members
+ * read as zeros, like with archive_read_data(). */
+struct member {
+	struct archive *a;
+	struct xhash hash;
+	unsigned long long size;
+	const void *block;
+	size_t block_size;
+	unsigned long long block_offset;
+	int pending;
+	/* the pending block is the hole at the end of the member */
+	int last;
+	int eof;
+	/* 1 when the member cannot be read, -1 when the archive cannot */
+	int error;
+	char xerror[MD5_DIGEST_LENGTH * 2 + 1];
+};
+
+static const char zero_block[ZERO_BLOCK_SIZE];
+
+static void member_error(struct member *m, const char *error)
+{
+	m->error = 1;
+	set_xerror(m->xerror, sizeof (m->xerror), "bad afile", error);
+}
+
+/* the next bytes of the member, 0 at its end or on an error */
+static ssize_t member_read(struct member *m, const void **buf)
+{
+	la_int64_t offset;
+	size_t size;
+	int retry, ret, phase;
+
+	do {
+		if (m->eof || m->error) return 0;
+		if (!m->pending) {
+			offset = 0;
+			for (retry = 0; retry <= RETRY_ARCHIVE_COUNT; ++retry) {
+				ret = archive_read_data_block(m->a, &m->block, &m->block_size, &offset);
+				if (ret != ARCHIVE_RETRY) break;
+			}
+			if (ret == ARCHIVE_EOF) {
+				/* a sparse member can end with a hole */
+				if (offset <= 0 || (unsigned long long)offset <= m->size) {
+					m->eof = 1;
+					return 0;
+				}
+				m->block_size = 0;
+				m->last = 1;
+			}
+			if (ret == ARCHIVE_FATAL) {
+				m->error = -1;
+				return 0;
+			}
+			/* as with archive_read_data(), a warning like a bad CRC
+			 * fails the member */
+			if (ret != ARCHIVE_OK && ret != ARCHIVE_EOF) {
+				member_error(m, archive_error_string(m->a));
+				return 0;
+			}
+			if (offset < 0 || (unsigned long long)offset < m->size) {
+				member_error(m, "out of order sparse blocks");
+				return 0;
+			}
+			m->block_offset = offset;
+			m->pending = 1;
+		}
+		if (m->block_offset > m->size) {
+			size = m->block_offset - m->size < ZERO_BLOCK_SIZE ?
+			       m->block_offset - m->size : ZERO_BLOCK_SIZE;
+			*buf = zero_block;
+		} else {
+			size = m->block_size;
+			*buf = m->block;
+			m->pending = 0;
+			m->eof = m->last;
+		}
+	} while (size == 0);
+	phase = stats_phase(PHASE_HASH);
+	ret = xhash_update(&m->hash, *buf, size);
+	stats_phase(phase);
+	if (ret != 0) {
+		member_error(m, archive_error_string(m->a));
+		return 0;
+	}
+	m->size += size;
+	return size;
+}
+
+/* A member that is an archive itself is listed with -r, through the
+ * callback API from the data of the outer member as it is read: its
+ * first SNIFF_SIZE bytes are copied to check its signature, then given
+ * back before the rest. The lines of its members are held until it is
+ * listed completely, at most option_sort_memory bytes of them. */
+struct nested_source {
+	struct member *m;
+	char *head;
+	size_t head_len;
+	const char *rest;
+	size_t rest_len;
+	int head_read;
+};
+
+static la_ssize_t nested_read(struct archive *a, void *client_data,
+                              const void **buffer)
+{
+	struct nested_source *src = (struct nested_source *)client_data;
+	ssize_t size;
+
+	(void)a;
+	if (!src->head_read) {
+		src->head_read = 1;
+		*buffer = src->head;
+		if (src->head_len) return src->head_len;
+	}
+	if (src->rest_len) {
+		*buffer = src->rest;
+		size = src->rest_len;
+		src->rest_len = 0;
+		return size;
+	}
+	size = member_read(src->m, buffer);
+	return size > 0 || !src->m->error ? size : ARCHIVE_FATAL;
+}
+
+/* move the lines of from, which does not spill, to the end of to; -1
+ * with the lines left freed */
+static int listing_move(struct listing *to, struct listing *from)
+{
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < from->count; ++i) {
+		if (ret == 0 && listing_add(to, from->lines[i]) != 0) ret = -1;
+		if (ret != 0) free(from->lines[i]);
+	}
+	from->count = 0;
+	from->mem = 0;
+	return ret;
+}
+
+static int archive_member(struct archive *a, struct archive_entry *entry,
+                          unsigned long long name_error_counter, unsigned depth,
+                          struct listing *lines);
+
+/* the lines of the members of m, an archive, with prefix and the marker
+ * in front of their names, added to nested; -1 if it is not listed */
+static int archive_nested(struct member *m, const char *prefix, unsigned depth,
+                          struct listing *nested)
+{
+	struct nested_source src;
+	struct listing inner;
+	struct archive *a = NULL;
+	struct archive_entry *entry;
+	unsigned long long name_error_counter = 0;
+	const void *buf;
+	ssize_t size;
+	size_t i, n, prefix_len = strlen(prefix);
+	int rh_ret, retry;
+	int ret = -1;
+
+	memset(&src, 0, sizeof (src));
+	memset(&inner, 0, sizeof (inner));
+	inner.no_spill = 1;
+	src.m = m;
+	if (!(src.head = (char *)malloc(SNIFF_SIZE))) return -1;
+	while (src.head_len < SNIFF_SIZE && (size = member_read(m, &buf)) > 0) {
+		n = (size_t)size < SNIFF_SIZE - src.head_len ? (size_t)size : SNIFF_SIZE - src.head_len;
+		memcpy(src.head + src.head_len, buf, n);
+		src.head_len += n;
+		src.rest = (const char *)buf + n;
+		src.rest_len = size - n;
+	}
+	/* a short head is the whole member */
+	if (m->error || !archive_sniff(src.head, src.head_len, src.head_len)) goto end;
+
+	if (!(a = archive_read_new())) goto end;
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	archive_read_set_callback_data(a, &src);
+	archive_read_set_read_callback(a, nested_read);
+	for (retry = 0; retry <= RETRY_ARCHIVE_COUNT; ++retry) {
+		rh_ret = archive_read_open1(a);
+		if (rh_ret != ARCHIVE_RETRY) break;
+	}
+	if (rh_ret != ARCHIVE_OK && rh_ret != ARCHIVE_WARN) goto end;
+	for (;;) {
+		rh_ret = archive_next(a, &entry);
+		if (rh_ret != ARCHIVE_OK && rh_ret != ARCHIVE_WARN) break;
+		if (!archive_entry_pathname(entry)) ++name_error_counter;
+		if (archive_member(a, entry, name_error_counter, depth, &inner) != 0) goto end;
+		if (inner.mem > option_sort_memory) goto end;
+	}
+	if (rh_ret != ARCHIVE_EOF) goto end;
+
+	for (i = 0; i < inner.count; ++i) {
+		const char *line = inner.lines[i];
+		const char *name = get_name_field(line);
+		char *p = (char *)malloc(strlen(line) + prefix_len + 6);
+
+		if (!p) goto end;
+		sprintf(p, "%.*s%s%%%%%%%%/%s", (int)(name - line), line, prefix, name);
+		free(inner.lines[i]);
+		inner.lines[i] = p;
+	}
+	ret = listing_move(nested, &inner);
+end:
+	if (a) archive_read_free(a);
+	listing_free(&inner);
+	free(src.head);
+	return ret;
+}
+
+/* hash the data of the current member into its listing line, and with
+ * -r the lines of its own members, added to lines; -1 when the archive
+ * cannot be read any further */
+static int archive_member(struct archive *a, struct archive_entry *entry,
+                          unsigned long long name_error_counter, unsigned depth,
+                          struct listing *lines)
+{
+	struct member m;
+	struct listing nested;
+	unsigned char digest[MAX_DIGEST_LENGTH];
+	const void *buf;
+	const char *entry_pathname;
+	char *escaped_entry_pathname;
+	char *line = NULL;
+	int ret = -1;
+	int j;
+
+	entry_pathname = archive_entry_pathname(entry);
+	if (!entry_pathname) {
+		escaped_entry_pathname = malloc(256);
+		if (escaped_entry_pathname) {
+			sprintf(escaped_entry_pathname, "%%#0;BAD_NAME_%llu", name_error_counter);
+		} else {
+			entry_pathname = "%#0;";
+			escaped_entry_pathname = (char *)entry_pathname;
+		}
+	} else {
+		escaped_entry_pathname = escape_filename(entry_pathname);
+	}
+	memset(&m, 0, sizeof (m));
+	memset(&nested, 0, sizeof (nested));
+	nested.no_spill = 1;
+	m.a = a;
+	if (xhash_init(&m.hash) != 0) goto end;
+	if (depth < option_nest_depth && archive_entry_filetype(entry) == AE_IFREG) {
+		archive_nested(&m, escaped_entry_pathname, depth + 1, &nested);
+	}
+	/* what the nested archive did not read, or all of it */
+	while (member_read(&m, &buf) > 0);
+	if (xhash_final(&m.hash, digest) != 0 || m.error < 0) goto end;
+	stats_add(&stats->members, 1);
+	stats_add(&stats->member_bytes, m.size);
+
+	line = (char *)malloc(MAX_DIGEST_STR_LENGTH + 2 +
+	                      33 + strlen(escaped_entry_pathname) + 1);
+	if (!line) goto end;
+	if (m.error) {
+		sprintf(line, "%s  %15llu %s", m.xerror, 0ull, escaped_entry_pathname);
+	} else {
+		j = format_digest(line, digest);
+		sprintf(line + j, "  %15llu %s", m.size, escaped_entry_pathname);
+	}
+	if (listing_add(lines, line) != 0) goto end;
+	line = NULL;
+	/* the listing of a member that failed to read is partial */
+	if (m.error) listing_free(&nested);
+	ret = listing_move(lines, &nested);
+end:
+	free(line);
+	listing_free(&nested);
+	if (entry_pathname != escaped_entry_pathname) {
+		free(escaped_entry_pathname);
+	}
+	return ret;
+}
+
+/* Members of a large zip or iso9660 archive listed by -x threads. Each
+ * thread opens the archive on its own and walks all the headers, which
+ * the central directory makes cheap to skip, and claims the next member
+ * to decompress and hash from a shared counter. As the claims only go
+ * up, the member claimed is never behind the thread. */
+struct archive_split {
+	struct listing *list;
+	pthread_mutex_t mutex;
+	unsigned long long next;
+	int error;
+};
+
+struct archive_worker {
+	pthread_t thread;
+	struct xfile xf;
+	struct archive_split *split;
+	int ret;
+};
+
+/* list from the header rh_ret and entry on, only the members claimed
+ * from split if there is one */
+static int archive_list(struct archive *a, struct archive_entry *entry,
+                        int rh_ret, struct listing *list,
+                        struct archive_split *split)
+{
+	struct listing lines;
+	unsigned long long name_error_counter = 0;
+	unsigned long long index, target = 0;
+	int ret;
+
+	memset(&lines, 0, sizeof (lines));
+	lines.no_spill = 1;
+	if (split) target = __atomic_fetch_add(&split->next, 1, __ATOMIC_RELAXED);
+	for (index = 0; ; ++index, rh_ret = archive_next(a, &entry)) {
+		if (rh_ret != ARCHIVE_OK && rh_ret != ARCHIVE_WARN) break;
+		/* counted on every thread, for the same names */
+		if (!archive_entry_pathname(entry)) ++name_error_counter;
+		if (split && index != target) continue;
+		if (split && __atomic_load_n(&split->error, __ATOMIC_RELAXED)) break;
+		if (archive_member(a, entry, name_error_counter, 0, &lines) != 0) break;
+		if (split) {
+			pthread_mutex_lock(&split->mutex);
+			ret = listing_move(list, &lines);
+			pthread_mutex_unlock(&split->mutex);
+			target = __atomic_fetch_add(&split->next, 1, __ATOMIC_RELAXED);
+		} else {
+			ret = listing_move(list, &lines);
+		}
+		if (ret != 0) break;
+	}
+	listing_free(&lines);
+	return rh_ret == ARCHIVE_EOF ? 0 : -1;
+}
+
+static void *archive_worker_main(void *arg)
+{
+	struct archive_worker *w = (struct archive_worker *)arg;
+	struct archive_entry *entry;
+	struct archive *a;
+	int rh_ret;
+
+	stats_phase(PHASE_ARCHIVE);
+	w->ret = -1;
+	if ((a = archive_open(&w->xf))) {
+		rh_ret = archive_next(a, &entry);
+		w->ret = archive_list(a, entry, rh_ret, w->split->list, w->split);
+		if (archive_read_free(a) != ARCHIVE_OK) w->ret = -1;
+	}
+	if (w->ret != 0) __atomic_store_n(&w->split->error, 1, __ATOMIC_RELAXED);
+	stats_phase(PHASE_NONE);
+	return NULL;
+}
+
+/* the archive of xf is worth listing with several threads */
+static int archive_splits(struct archive *a, const struct xfile *xf)
+{
+	int format = archive_format(a) & ARCHIVE_FORMAT_BASE_MASK;
+
+	/* 7z is left out: skipping a member of a solid block decompresses it */
+	return option_archive_jobs > 1 && xf->size >= SPLIT_MIN_SIZE &&
+	       archive_filter_count(a) == 1 &&
+	       (format == ARCHIVE_FORMAT_ZIP || format == ARCHIVE_FORMAT_ISO9660);
+}
+
+/* start the other threads of a split listing, 0 if there is none */
+static unsigned archive_split_start(struct archive_split *split,
+                                     struct archive_worker *workers,
+                                     const struct xfile *xf)
+{
+	unsigned count;
+
+	for (count = 0; count < option_archive_jobs - 1; ++count) {
+		struct archive_worker *w = &workers[count];
+
+		memset(&w->xf, 0, sizeof (w->xf));
+		w->xf.fd = xf->fd;
+		w->xf.alg = -1;
+		w->xf.size = xf->size;
+		w->xf.keep = xf->keep;
+		/* only the reader of the caller hashes the file */
+		w->xf.hash_pos = UNKNOWN_SIZE;
+		w->split = split;
+		if (posix_memalign(&w->xf.buf, 4096, option_read_size) != 0) break;
+		if (pthread_create(&w->thread, NULL, archive_worker_main, w) != 0) {
+			free(w->xf.buf);
+			break;
+		}
+	}
+	return count;
+}
+
+static int archive_split_join(struct archive_worker *workers, unsigned count)
+{
+	unsigned i;
+	int ret = 0;
+
+	for (i = 0; i < count; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		free(workers[i].xf.buf);
+		if (workers[i].ret != 0) ret = -1;
+	}
+	return ret;
+}
+
+int do_xmd5_archive(struct xfile *xf, const char *escaped_filename,
+                    struct xbuf *out, FILE **spill)
+{
+	struct listing flist;
+	size_t out_len = out->len;
+	struct archive *a;
+	struct archive_entry *entry;
+	struct archive_split split;
+	struct archive_worker *workers = NULL;
+	unsigned worker_count = 0;
+	int rh_ret, ret;
+	int phase = stats_phase(PHASE_ARCHIVE);
+
+	memset(&flist, 0, sizeof (flist));
+	if (!(a = archive_open(xf))) goto bad_archive;
+	rh_ret = archive_next(a, &entry);
+	/* the format is known from the first header */
+	if ((rh_ret == ARCHIVE_OK || rh_ret == ARCHIVE_WARN) && archive_splits(a, xf) &&
+	    (workers = (struct archive_worker *)malloc((option_archive_jobs - 1) *
+	                                               sizeof (struct archive_worker)))) {
+		split.list = &flist;
+		pthread_mutex_init(&split.mutex, NULL);
+		split.next = 0;
+		split.error = 0;
+		worker_count = archive_split_start(&split, workers, xf);
+	}
+	if (worker_count) {
+		ret = archive_list(a, entry, rh_ret, &flist, &split);
+		if (ret != 0) __atomic_store_n(&split.error, 1, __ATOMIC_RELAXED);
+		if (archive_split_join(workers, worker_count) != 0) ret = -1;
+	} else {
+		ret = archive_list(a, entry, rh_ret, &flist, NULL);
+	}
+	if (workers) pthread_mutex_destroy(&split.mutex);
+	free(workers);
+	if (ret != 0) goto bad_archive2;
+	if (archive_read_free(a) != ARCHIVE_OK) goto bad_archive;
+
+	if (listing_output(&flist, escaped_filename, out, spill) != 0) goto bad_archive;
+	listing_free(&flist);
+
+	stats_phase(phase);
+	return 0;
+bad_archive2:
+	archive_read_free(a);
+bad_archive:
+	listing_free(&flist);
+	out->len = out_len;
+	stats_phase(phase);
+	return -1;
+}
+
+/* hash the open file fd, closing it; with spill, a large listing is left
+ * in a temporary file after out */
+int do_xmd5_fd(int fd,
+               const char *escaped_filename,
+               unsigned long long stat_size,
+               int list_archive,
+               struct xbuf *out,
+               FILE **spill)
+{
+	struct xfile xf;
+	struct stat st;
+	struct xbuf alist = { NULL, 0, 0 };
+	FILE *alist_spill = NULL;
+	unsigned char digest[MAX_DIGEST_LENGTH];
+	int ret;
+
+	memset(&xf, 0, sizeof (xf));
+	xf.fd = fd;
+	xf.alg = alg_open();
+	stats_add(&stats->files, 1);
+	if (xhash_init(&xf.hash) != 0) goto bad_file2_hash;
+	if (fstat(xf.fd, &st) != 0) goto bad_file2_errno;
+	xf.size = st.st_size;
+	xf.keep = noreuse_keep(xf.fd, xf.size);
+	if ((ret = posix_memalign(&xf.buf, 4096, option_read_size)) != 0) {
+		xf.buf = NULL;
+		errno = ret;
+		goto bad_file2_errno;
+	}
+	posix_fadvise(xf.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#ifndef NO_ARCHIVES
+	if (list_archive && !option_all_archives && !xfile_sniff(&xf)) list_archive = 0;
+	if (list_archive) do_xmd5_archive(&xf, escaped_filename, &alist, spill ? &alist_spill : NULL);
+#else
+	(void)list_archive;
+#endif
+	if (xf.error == 0) xfile_hash_to(&xf, UNKNOWN_SIZE);
+	if ((xf.alg >= 0 ? alg_final(xf.alg, digest) : xhash_final(&xf.hash, digest)) != 0) {
+		goto bad_file2_hash;
+	}
+	if (xf.error == XFILE_EHASH) goto bad_file2_hash;
+	if (xf.error == XFILE_EREAD) goto bad_file2_ferror;
+	free(xf.buf);
+	xf.buf = NULL;
+	if (xf.alg >= 0) close(xf.alg);
+	xf.alg = -1;
+
+	if (close(xf.fd) != 0) goto bad_file_errno;
+	if (stat_size != UNKNOWN_SIZE && stat_size != xf.hash_pos) goto bad_file_size;
+	print_hash_line(digest, xf.hash_pos, escaped_filename, out);
+	if (alist.len) xbuf_append(out, &alist);
+	xbuf_free(&alist);
+	if (alist_spill) *spill = alist_spill;
+
+	return 0;
+bad_file2_errno:
+	print_error_line("bad file", strerror(errno), escaped_filename, out);
+	goto file_error2;
+bad_file2_hash:
+	print_error_line("bad file", "checksum", escaped_filename, out);
+	goto file_error2;
+bad_file2_ferror:
+	print_error_line("bad file", "ferror", escaped_filename, out);
+	goto file_error2;
+bad_file_errno:
+	print_error_line("bad file", strerror(errno), escaped_filename, out);
+	goto file_error;
+bad_file_size:
+	print_error_line("bad file", "size", escaped_filename, out);
+	goto file_error;
+file_error2:
+	close(xf.fd);
+file_error:
+	if (xf.alg >= 0) close(xf.alg);
+	free(xf.buf);
+	xbuf_free(&alist);
+	if (alist_spill) fclose(alist_spill);
+	return -1;
+}
+
+int do_xmd5_file(const char *filename,
+                 const char *escaped_filename,
+                 unsigned long long stat_size,
+                 int list_archive,
+                 struct xbuf *out,
+                 FILE **spill)
+{
+	int fd;
+
+	throttle_file();
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		print_error_line("bad file", strerror(errno), escaped_filename, out);
+		return -1;
+	}
+	return do_xmd5_fd(fd, escaped_filename, stat_size, list_archive, out, spill);
+}
+
+#if !defined(NO_ARCHIVES) && defined(DO_FORK)
+/* Long-lived child process hashing and listing the files of one thread,
+ * so that a crash in libarchive only costs that child and the listing of
+ * the file it was working on. Files are opened by the parent and passed
+ * over the socket. */
+struct sandbox {
+	pid_t pid;
+	int sock;
+};
+
+struct sandbox_request {
+	unsigned long long stat_size;
+	size_t name_len;
+};
+
+/* followed by len bytes of output, and with the fd of the temporary file
+ * of a large listing attached if spill is set */
+struct sandbox_reply {
+	unsigned long long len;
+	int spill;
+};
+
+static int write_full(int fd, const void *data, size_t size)
+{
+	const char *p = (const char *)data;
+	ssize_t wsize;
+
+	while (size > 0) {
+		wsize = send(fd, p, size, MSG_NOSIGNAL);
+		if (wsize < 0 && errno == EINTR) continue;
+		if (wsize <= 0) return -1;
+		p += wsize;
+		size -= wsize;
+	}
+	return 0;
+}
+
+static int read_full(int fd, void *data, size_t size)
+{
+	char *p = (char *)data;
+	ssize_t rsize;
+
+	while (size > 0) {
+		rsize = read(fd, p, size);
+		if (rsize < 0 && errno == EINTR) continue;
+		if (rsize <= 0) return -1;
+		p += rsize;
+		size -= rsize;
+	}
+	return 0;
+}
+
+/* write data, with fd attached if it is not -1 */
+static int send_fd(int sock, const void *data, size_t size, int fd)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof (int))];
+	} cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *h;
+	ssize_t wsize;
+
+	memset(&msg, 0, sizeof (msg));
+	memset(&cmsg, 0, sizeof (cmsg));
+	iov.iov_base = (void *)data;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = sizeof (cmsg.buf);
+		h = CMSG_FIRSTHDR(&msg);
+		h->cmsg_level = SOL_SOCKET;
+		h->cmsg_type = SCM_RIGHTS;
+		h->cmsg_len = CMSG_LEN(sizeof (int));
+		memcpy(CMSG_DATA(h), &fd, sizeof (int));
+	}
+	do {
+		wsize = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (wsize < 0 && errno == EINTR);
+	if (wsize <= 0) return -1;
+	return write_full(sock, (const char *)data + wsize, size - wsize);
+}
+
+/* read size bytes of data, and the fd attached to them, -1 if none */
+static int recv_fd(int sock, void *data, size_t size, int *fd)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof (int))];
+	} cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *h;
+	ssize_t rsize;
+
+	*fd = -1;
+	memset(&msg, 0, sizeof (msg));
+	iov.iov_base = data;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof (cmsg.buf);
+	do {
+		rsize = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (rsize < 0 && errno == EINTR);
+	if (rsize <= 0) return -1;
+	for (h = CMSG_FIRSTHDR(&msg); h; h = CMSG_NXTHDR(&msg, h)) {
+		if (h->cmsg_level == SOL_SOCKET && h->cmsg_type == SCM_RIGHTS) {
+			memcpy(fd, CMSG_DATA(h), sizeof (int));
+		}
+	}
+	if (read_full(sock, (char *)data + rsize, size - rsize) != 0) {
+		if (*fd >= 0) close(*fd);
+		*fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static __thread struct sandbox sandbox = { 0, -1 };
+
+static void sandbox_main(int sock)
+{
+	struct xbuf out = { NULL, 0, 0 };
+	struct rlimit rl;
+	char *name = NULL;
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	rl.rlim_cur = rl.rlim_max = 0;
+	setrlimit(RLIMIT_CORE, &rl);
+	for (;;) {
+		struct sandbox_request req;
+		struct sandbox_reply reply;
+		FILE *spill = NULL;
+		int fd, ret;
+
+		if (recv_fd(sock, &req, sizeof (req), &fd) != 0 || fd < 0) break;
+		free(name);
+		if (!(name = (char *)malloc(req.name_len + 1))) break;
+		if (read_full(sock, name, req.name_len) != 0) break;
+		name[req.name_len] = '\0';
+
+		out.len = 0;
+		do_xmd5_fd(fd, name, req.stat_size, 1, &out, &spill);
+		memset(&reply, 0, sizeof (reply));
+		reply.len = out.len;
+		reply.spill = spill != NULL;
+		/* the parent reads the listing from its own fd of the file */
+		ret = send_fd(sock, &reply, sizeof (reply), spill ? fileno(spill) : -1);
+		if (spill) fclose(spill);
+		if (ret != 0 || write_full(sock, out.data, out.len) != 0) break;
+		/* do not hold on to the buffer of a large listing */
+		if (out.alloc_size > option_sort_memory) xbuf_free(&out);
+	}
+	_exit(0);
+}
+
+static void sandbox_stop(void)
+{
+	if (sandbox.pid <= 0) return;
+	close(sandbox.sock);
+	waitpid(sandbox.pid, NULL, 0);
+	sandbox.pid = 0;
+	sandbox.sock = -1;
+}
+
+static int sandbox_start(void)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) return -1;
+	pid = fork();
+	if (pid == 0) {
+		/* do not hold the sockets of the other threads open */
+		dup2(fds[1], STDOUT_FILENO);
+		close_range(STDERR_FILENO + 1, ~0U, 0);
+		alg_sock = alg_pipe[0] = alg_pipe[1] = -1;
+		sandbox_main(STDOUT_FILENO);
+	}
+	close(fds[1]);
+	if (pid == -1) {
+		close(fds[0]);
+		return -1;
+	}
+	sandbox.pid = pid;
+	sandbox.sock = fds[0];
+	return 0;
+}
+
+/* hash and list the file fd in the sandbox, (re)starting it if needed */
+static int sandbox_run(int fd, const char *escaped_filename,
+                       unsigned long long stat_size, struct xbuf *out,
+                       FILE **spill)
+{
+	struct sandbox_request req;
+	struct sandbox_reply reply;
+	int spill_fd;
+
+	if (sandbox.pid <= 0 && sandbox_start() != 0) return -1;
+
+	memset(&req, 0, sizeof (req));
+	req.stat_size = stat_size;
+	req.name_len = strlen(escaped_filename);
+	if (send_fd(sandbox.sock, &req, sizeof (req), fd) != 0 ||
+	    write_full(sandbox.sock, escaped_filename, req.name_len) != 0) goto bad_sandbox;
+	if (recv_fd(sandbox.sock, &reply, sizeof (reply), &spill_fd) != 0) goto bad_sandbox;
+	if (reply.spill ? spill_fd < 0 || !(*spill = fdopen(spill_fd, "r")) : spill_fd >= 0) {
+		if (spill_fd >= 0) close(spill_fd);
+		goto bad_sandbox;
+	}
+	if (xbuf_reserve(out, reply.len) != 0) goto bad_sandbox;
+	if (read_full(sandbox.sock, out->data + out->len, reply.len) != 0) goto bad_sandbox;
+	out->len += reply.len;
+	return 0;
+bad_sandbox:
+	if (*spill) fclose(*spill);
+	*spill = NULL;
+	kill(sandbox.pid, SIGKILL);
+	sandbox_stop();
+	return -1;
+}
+#else
+static void sandbox_stop(void)
+{
+}
+#endif
+
+/* Output slot. Slots are written to stdout in the order they were created
+ * by the traversal, whichever thread completes them. */
+struct job {
+	struct job *next;
+	struct job *next_work;
+	void (*run)(struct job *j);
+	char *filename;
+	char *escaped_filename;
+	unsigned long long stat_size;
+	struct file_key key;
+	unsigned long long disk_order;
+	unsigned long long nlink;
+	struct xbuf out;
+	/* a large archive listing merged on disk, written after out */
+	FILE *spill;
+	/* with -C, the last entry of the traversal with its output up to here */
+	char *pos;
+	unsigned pos_arg;
+	/* when a thread started on it, for the progress reports */
+	unsigned long long started;
+	int link;
+	int done;
+};
+
+struct job_queue {
+	struct job *head;
+	struct job *tail;
+	size_t count;
+	int end;
+	pthread_cond_t cond;
+};
+
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static struct job *out_head = NULL;
+static struct job *out_tail = NULL;
+static size_t out_count = 0;
+static struct job_queue work_queue = {
+	NULL, NULL, 0, 0, PTHREAD_COND_INITIALIZER
+};
+/* files handed over by the io_uring engine */
+static struct job_queue archive_queue = {
+	NULL, NULL, 0, 0, PTHREAD_COND_INITIALIZER
+};
+static size_t work_queue_limit = 0;
+/* output slots, done or not, held behind the first one not done */
+static size_t out_limit = 0;
+static struct job *trav_job = NULL;
+static pthread_t *workers = NULL;
+static unsigned worker_count = 0;
+static pthread_t uring_thread;
+static int threaded = 0;
+
+/* job_mutex must be held */
+static void queue_push(struct job_queue *q, struct job *j)
+{
+	j->next_work = NULL;
+	if (q->tail) {
+		q->tail->next_work = j;
+	} else {
+		q->head = j;
+	}
+	q->tail = j;
+	++q->count;
+	pthread_cond_signal(&q->cond);
+}
+
+/* job_mutex must be held, NULL when the queue is empty (and ended if wait) */
+static struct job *queue_pop(struct job_queue *q, int wait)
+{
+	struct job *j;
+
+	while (wait && !q->head && !q->end) pthread_cond_wait(&q->cond, &job_mutex);
+	if (!(j = q->head)) return NULL;
+	q->head = j->next_work;
+	if (!q->head) q->tail = NULL;
+	--q->count;
+	return j;
+}
+
+static void queue_end(struct job_queue *q)
+{
+	pthread_mutex_lock(&job_mutex);
+	q->end = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&job_mutex);
+}
+
+static void job_done(struct job *j)
+{
+	pthread_mutex_lock(&job_mutex);
+	j->done = 1;
+	pthread_cond_broadcast(&done_cond);
+	pthread_mutex_unlock(&job_mutex);
+}
+
+static struct job *add_job(void)
+{
+	struct job *j = (struct job *)calloc(1, sizeof (struct job));
+
+	if (!j) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_lock(&job_mutex);
+	if (out_tail) {
+		out_tail->next = j;
+	} else {
+		out_head = j;
+	}
+	out_tail = j;
+	++out_count;
+	pthread_mutex_unlock(&job_mutex);
+	return j;
+}
+
+static void free_job(struct job *j)
+{
+	if (j->escaped_filename != j->filename) free(j->escaped_filename);
+	free(j->filename);
+	free(j->pos);
+	xbuf_free(&j->out);
+	if (j->spill) fclose(j->spill);
+	free(j);
+}
+
+static void flush_link(struct job *j);
+static int link_unhashed(const struct job *j);
+static void run_hash_job(struct job *j);
+static void checkpoint_flushed(struct job *j);
+
+/* -B output */
+static struct xlist out_list;
+
+static void write_output(const struct xbuf *out)
+{
+	const char *p, *eol, *end = out->data + out->len;
+
+	if (!option_binary) {
+		fwrite(out->data, 1, out->len, stdout);
+		return;
+	}
+	for (p = out->data; p < end; p = eol + 1) {
+		if (!(eol = (const char *)memchr(p, '\n', end - p))) eol = end;
+		if (xlist_write_line(&out_list, p, eol - p) != 0) {
+			fprintf(stderr, "cannot write line: %.*s\n", (int)(eol - p), p);
+		}
+	}
+}
+
+/* copy a listing merged on disk to the output, a line at a time for -B */
+static void write_spill(FILE *f)
+{
+	struct xbuf line = { NULL, 0, 0 };
+	ssize_t len;
+
+	if (fseek(f, 0, SEEK_SET) != 0) {
+		perror("listing");
+		return;
+	}
+	while ((len = getline(&line.data, &line.alloc_size, f)) > 0) {
+		line.len = len;
+		write_output(&line);
+	}
+	if (ferror(f)) perror("listing");
+	xbuf_free(&line);
+}
+
+static void flush_jobs(int wait_all)
+{
+	struct job *j;
+
+	pthread_mutex_lock(&job_mutex);
+	for (;;) {
+		while (wait_all && out_head && !out_head->done) {
+			pthread_cond_wait(&done_cond, &job_mutex);
+		}
+		if (!out_head || !out_head->done) break;
+		j = out_head;
+		if (j->link && threaded && link_unhashed(j)) {
+			/* the first name could not be hashed, this one is hashed
+			 * by the workers in its place */
+			j->link = 0;
+			j->done = 0;
+			queue_push(&work_queue, j);
+			continue;
+		}
+		out_head = j->next;
+		if (!out_head) out_tail = NULL;
+		--out_count;
+		pthread_mutex_unlock(&job_mutex);
+		if (j->nlink > 1 && j->run == run_hash_job) flush_link(j);
+		if (j->out.len) write_output(&j->out);
+		if (j->spill) write_spill(j->spill);
+		if (j->run == run_hash_job) {
+			stats_add(&stats->done_files, 1);
+			stats_add(&stats->done_bytes, j->stat_size);
+		}
+		if (option_checkpoint) checkpoint_flushed(j);
+		free_job(j);
+		pthread_mutex_lock(&job_mutex);
+	}
+	pthread_mutex_unlock(&job_mutex);
+}
+
+static void close_trav_job(void)
+{
+	if (!trav_job) return;
+	pthread_mutex_lock(&job_mutex);
+	trav_job->done = 1;
+	pthread_mutex_unlock(&job_mutex);
+	trav_job = NULL;
+}
+
+/* buffer for the lines produced by the traversal itself */
+static struct xbuf *trav_out(void)
+{
+	if (!trav_job) trav_job = add_job();
+	return &trav_job->out;
+}
+
+static void cache_store_file(const struct job *j);
+
+static int list_cache_probe(const struct job *j);
+static int list_cache_output(struct job *j);
+static void list_cache_store(const struct job *j);
+
+/* hash and list the file of j, 0 when the output is complete */
+static int hash_list_job(struct job *j)
+{
+#if !defined(NO_ARCHIVES) && defined(DO_FORK)
+	if (option_archives) {
+		int fd;
+
+		throttle_file();
+		if ((fd = open(j->filename, O_RDONLY)) < 0) {
+			print_error_line("bad file", strerror(errno), j->escaped_filename, &j->out);
+			return -1;
+		}
+		/* the sandbox is only worth it for the archives */
+		if (!option_all_archives && !fd_sniff(fd, j->stat_size)) {
+			return do_xmd5_fd(fd, j->escaped_filename, j->stat_size, 0, &j->out, NULL);
+		}
+		if (sandbox_run(fd, j->escaped_filename, j->stat_size, &j->out, &j->spill) == 0) {
+			close(fd);
+			return 0;
+		}
+		/* the sandbox died on this file: hash it without the listing */
+		do_xmd5_fd(fd, j->escaped_filename, j->stat_size, 0, &j->out, NULL);
+		return -1;
+	}
+#endif
+	return do_xmd5_file(j->filename, j->escaped_filename, j->stat_size,
+	                    option_archives, &j->out, &j->spill);
+}
+
+/* 1 if the file of j may be an archive, for -a */
+static int job_sniff(const struct job *j)
+{
+	int fd, ret;
+
+	if (option_all_archives) return 1;
+	/* let the hash report the error */
+	if ((fd = open(j->filename, O_RDONLY | O_CLOEXEC)) < 0) return 0;
+	ret = fd_sniff(fd, j->stat_size);
+	close(fd);
+	return ret;
+}
+
+static void run_hash_job(struct job *j)
+{
+	/* an archive is hashed first when an archive of its size has its
+	 * listing cached, it may be the same content; the other files are
+	 * hashed and listed in a single pass, which gives the digest to
+	 * store the listing under */
+	int list_cache = option_list_cache && option_archives && job_sniff(j);
+
+	if (list_cache && list_cache_probe(j)) {
+		if (do_xmd5_file(j->filename, j->escaped_filename, j->stat_size,
+		                 0, &j->out, NULL) != 0) return;
+		if (list_cache_output(j) == 0) {
+			if (option_cache) cache_store_file(j);
+			return;
+		}
+		j->out.len = 0;
+	}
+	if (hash_list_job(j) != 0) return;
+	if (list_cache) list_cache_store(j);
+	if (option_cache) cache_store_file(j);
+}
+
+static void *worker_main(void *arg)
+{
+	struct job_queue *q = (struct job_queue *)arg;
+	struct job *j;
+
+	for (;;) {
+		pthread_mutex_lock(&job_mutex);
+		j = queue_pop(q, 1);
+		pthread_mutex_unlock(&job_mutex);
+		if (!j) break;
+		__atomic_store_n(&j->started, now_ns(), __ATOMIC_RELAXED);
+		j->run(j);
+		job_done(j);
+	}
+	sandbox_stop();
+	return NULL;
+}
+
+/* io_uring engine (-u): a single thread keeps the opens and reads of many
+ * files in flight and hashes the blocks of each file in order as they
+ * complete. libarchive needs a synchronous reader, so the files whose
+ * archive listing is wanted are handed over to the workers after their
+ * first block. With MD5 and SIMD, the blocks that complete together are
+ * hashed in the lanes of the multi-buffer kernel. */
+struct uring_file {
+	struct job *job;
+	int fd;
+	struct xhash hash;
+	struct md5mb_stream mb;
+	int pending;
+	unsigned long long submit_pos;
+	unsigned long long hash_pos;
+	char *bufs[URING_FILE_READS];
+	unsigned long long buf_pos[URING_FILE_READS];
+	int buf_len[URING_FILE_READS];
+	/* bytes read so far into a busy buffer */
+	int buf_got[URING_FILE_READS];
+	int inflight;
+	int started;
+	int eof;
+	int handover;
+	int error;
+	int open_errno;
+	/* -N leaves the file in the page cache */
+	int keep;
+};
+
+#define URING_BUF_FREE -1
+#define URING_BUF_BUSY -2
+#define URING_OPEN_TAG 0xff
+
+static int uring_mb = 0;
+
+/* block is the first block of the file */
+static int uring_hands_over(const struct uring_file *uf, const char *block, size_t len)
+{
+	if (!option_archives) return 0;
+	return option_all_archives || archive_sniff(block, len, uf->job->stat_size);
+}
+
+/* read the rest of the block of buffer b */
+static void uring_read_rest(struct uring *r, struct uring_file *uf,
+                            unsigned slot, unsigned b)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(r);
+	unsigned len = URING_BLOCK_SIZE - uf->buf_got[b];
+
+	/* the ring has room for every read of every slot */
+	/* the engine waits for the tokens, there is no latency backoff */
+	throttle_read(len);
+	sqe->opcode = IORING_OP_READ;
+	sqe->ioprio = option_ioprio;
+	sqe->fd = uf->fd;
+	sqe->addr = (unsigned long)(uf->bufs[b] + uf->buf_got[b]);
+	sqe->len = len;
+	sqe->off = uf->buf_pos[b] + uf->buf_got[b];
+	sqe->user_data = (slot << 8) | b;
+	++uf->inflight;
+}
+
+static void uring_submit_read(struct uring *r, struct uring_file *uf,
+                              unsigned slot, unsigned b)
+{
+	uf->buf_pos[b] = uf->submit_pos;
+	uf->buf_len[b] = URING_BUF_BUSY;
+	uf->buf_got[b] = 0;
+	uf->submit_pos += URING_BLOCK_SIZE;
+	uring_read_rest(r, uf, slot, b);
+}
+
+static void uring_fill(struct uring *r, struct uring_file *uf, unsigned slot)
+{
+	/* only the first block until it is known the file stays here */
+	int max_reads = uf->started ? URING_FILE_READS : 1;
+	unsigned b;
+
+	for (b = 0; b < URING_FILE_READS && uf->inflight < max_reads; ++b) {
+		if (uf->eof || uf->error || uf->handover) return;
+		if (uf->buf_len[b] != URING_BUF_FREE) continue;
+		/* past the expected size, one read at a time finds the end */
+		if (uf->submit_pos >= uf->job->stat_size && uf->inflight > 0) return;
+		uring_submit_read(r, uf, slot, b);
+	}
+}
+
+static void uring_start(struct uring *r, struct uring_file *uf,
+                        unsigned slot, struct job *j)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(r);
+	unsigned b;
+
+	uf->job = j;
+	__atomic_store_n(&j->started, now_ns(), __ATOMIC_RELAXED);
+	uf->fd = -1;
+	uf->submit_pos = uf->hash_pos = 0;
+	uf->inflight = 1;
+	uf->started = uf->eof = uf->handover = uf->error = uf->open_errno = 0;
+	uf->pending = 0;
+	for (b = 0; b < URING_FILE_READS; ++b) uf->buf_len[b] = URING_BUF_FREE;
+	if (uring_mb) {
+		md5mb_init(&uf->mb);
+	} else if (xhash_init(&uf->hash) != 0) {
+		uf->error = XFILE_EHASH;
+	}
+	throttle_file();
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)j->filename;
+	sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	sqe->user_data = (slot << 8) | URING_OPEN_TAG;
+}
+
+static int uring_final(struct uring_file *uf, unsigned char *digest)
+{
+	if (!uring_mb) return xhash_final(&uf->hash, digest);
+	md5mb_final(&uf->mb, digest);
+	return 0;
+}
+
+static void uring_finish(struct uring_file *uf)
+{
+	struct job *j = uf->job;
+	unsigned char digest[MAX_DIGEST_LENGTH];
+
+	uf->job = NULL;
+	if (uf->handover) {
+		close(uf->fd);
+		pthread_mutex_lock(&job_mutex);
+		queue_push(&archive_queue, j);
+		pthread_mutex_unlock(&job_mutex);
+		return;
+	}
+	if (uf->open_errno) {
+		print_error_line("bad file", strerror(uf->open_errno), j->escaped_filename, &j->out);
+	} else if (uring_final(uf, digest) != 0 || uf->error == XFILE_EHASH) {
+		close(uf->fd);
+		print_error_line("bad file", "checksum", j->escaped_filename, &j->out);
+	} else if (uf->error == XFILE_EREAD) {
+		close(uf->fd);
+		print_error_line("bad file", "ferror", j->escaped_filename, &j->out);
+	} else if (close(uf->fd) != 0) {
+		print_error_line("bad file", strerror(errno), j->escaped_filename, &j->out);
+	} else if (j->stat_size != uf->hash_pos) {
+		print_error_line("bad file", "size", j->escaped_filename, &j->out);
+	} else {
+		print_hash_line(digest, uf->hash_pos, j->escaped_filename, &j->out);
+		if (option_cache) cache_store_file(j);
+	}
+	job_done(j);
+}
+
+/* the buffer of the next block to hash, -1 if it is not read yet */
+static int uring_next_buf(const struct uring_file *uf)
+{
+	unsigned b;
+
+	if (uf->eof || uf->error) return -1;
+	for (b = 0; b < URING_FILE_READS; ++b) {
+		if (uf->buf_len[b] >= 0 && uf->buf_pos[b] == uf->hash_pos) return b;
+	}
+	return -1;
+}
+
+static void uring_hashed(struct uring_file *uf, unsigned b)
+{
+	if (!uf->started) {
+		uf->started = 1;
+		uf->handover = uring_hands_over(uf, uf->bufs[b], uf->buf_len[b]);
+	}
+	/* a file handed over is read again by libarchive */
+	if (!uf->handover) noreuse_drop(uf->fd, uf->hash_pos, uf->buf_len[b], uf->keep);
+	uf->hash_pos += uf->buf_len[b];
+	if (uf->buf_len[b] < URING_BLOCK_SIZE) uf->eof = 1;
+	uf->buf_len[b] = URING_BUF_FREE;
+}
+
+/* returns 1 when the file is done */
+static int uring_progress(struct uring *r, struct uring_file *uf, unsigned slot)
+{
+	unsigned b;
+
+	if (uf->eof || uf->error || uf->handover) {
+		/* reads past the end or after an error are of no use */
+		for (b = 0; b < URING_FILE_READS; ++b) {
+			if (uf->buf_len[b] >= 0) uf->buf_len[b] = URING_BUF_FREE;
+		}
+		return uf->inflight == 0;
+	}
+	uring_fill(r, uf, slot);
+	return 0;
+}
+
+/* returns 1 when the file is done */
+static int uring_complete(struct uring *r, struct uring_file *uf,
+                          unsigned slot, unsigned b, int res)
+{
+	int next;
+	int phase;
+
+	if (b == URING_OPEN_TAG) {
+		--uf->inflight;
+		if (res < 0) {
+			uf->open_errno = -res;
+			return 1;
+		}
+		uf->fd = res;
+		stats_add(&stats->files, 1);
+		uf->keep = noreuse_keep(uf->fd, uf->job->stat_size);
+		uring_fill(r, uf, slot);
+		return 0;
+	}
+
+	--uf->inflight;
+	if (res > 0) {
+		stats_add(&stats->bytes, res);
+		uf->buf_got[b] += res;
+		/* a short read is not the end of the file on NFS or FUSE: the
+		 * end is a read of 0 bytes, or the size from stat */
+		if (uf->buf_got[b] < URING_BLOCK_SIZE &&
+		    uf->buf_pos[b] + uf->buf_got[b] != uf->job->stat_size &&
+		    !uf->eof && !uf->error && !uf->handover) {
+			uring_read_rest(r, uf, slot, b);
+			return 0;
+		}
+	}
+	uf->buf_len[b] = uf->buf_got[b];
+	if (res < 0) uf->error = XFILE_EREAD;
+	if (uring_mb) {
+		/* left to uring_hash_mb() with the other completions */
+		uf->pending = 1;
+		return 0;
+	}
+	phase = stats_phase(PHASE_HASH);
+	while ((next = uring_next_buf(uf)) >= 0) {
+		if (xhash_update(&uf->hash, uf->bufs[next], uf->buf_len[next]) != 0) {
+			uf->error = XFILE_EHASH;
+		}
+		uring_hashed(uf, next);
+	}
+	stats_phase(phase);
+	return uring_progress(r, uf, slot);
+}
+
+/* hash the blocks of all the files in order, returns the number of files done */
+static unsigned uring_hash_mb(struct uring *r, struct uring_file *files)
+{
+	struct md5mb_stream *s[URING_FILES];
+	const unsigned char *data[URING_FILES];
+	size_t len[URING_FILES];
+	unsigned char bufs[URING_FILES];
+	unsigned slots[URING_FILES];
+	unsigned count, done = 0, slot, i;
+	int b;
+	int phase;
+
+	phase = stats_phase(PHASE_HASH);
+	do {
+		count = 0;
+		for (slot = 0; slot < URING_FILES; ++slot) {
+			if (!files[slot].pending || (b = uring_next_buf(&files[slot])) < 0) continue;
+			s[count] = &files[slot].mb;
+			data[count] = (const unsigned char *)files[slot].bufs[b];
+			len[count] = files[slot].buf_len[b];
+			bufs[count] = b;
+			slots[count++] = slot;
+		}
+		md5mb_update_many(s, data, len, count);
+		for (i = 0; i < count; ++i) uring_hashed(&files[slots[i]], bufs[i]);
+	} while (count > 0);
+	stats_phase(phase);
+
+	for (slot = 0; slot < URING_FILES; ++slot) {
+		if (!files[slot].pending) continue;
+		files[slot].pending = 0;
+		if (uring_progress(r, &files[slot], slot)) {
+			uring_finish(&files[slot]);
+			++done;
+		}
+	}
+	return done;
+}
+
+static void *uring_main(void *arg)
+{
+	struct uring r;
+	struct uring_file *files;
+	struct io_uring_cqe *cqe;
+	struct job *j;
+	unsigned slot, b;
+	unsigned active = 0;
+	int ret;
+
+	(void)arg;
+	if (uring_init(&r, URING_FILES * URING_FILE_READS) != 0) {
+		fprintf(stderr, "io_uring: %s, using the read path\n", strerror(errno));
+		return worker_main(&work_queue);
+	}
+	uring_mb = option_hash == HASH_MD5 && md5mb_lanes() > 1;
+	files = (struct uring_file *)calloc(URING_FILES, sizeof (struct uring_file));
+	if (!files) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (slot = 0; slot < URING_FILES; ++slot) {
+		for (b = 0; b < URING_FILE_READS; ++b) {
+			if (posix_memalign((void **)&files[slot].bufs[b], 4096, URING_BLOCK_SIZE) != 0) {
+				perror("posix_memalign");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	for (;;) {
+		for (slot = 0; slot < URING_FILES; ++slot) {
+			if (files[slot].job) continue;
+			pthread_mutex_lock(&job_mutex);
+			j = queue_pop(&work_queue, active == 0);
+			pthread_mutex_unlock(&job_mutex);
+			if (!j) break;
+			if (j->run != run_hash_job) {
+				/* the blocking reads of -p go to the workers */
+				if (worker_count) {
+					pthread_mutex_lock(&job_mutex);
+					queue_push(&archive_queue, j);
+					pthread_mutex_unlock(&job_mutex);
+				} else {
+					j->run(j);
+					job_done(j);
+				}
+				--slot;
+				continue;
+			}
+			uring_start(&r, &files[slot], slot, j);
+			++active;
+		}
+		if (!active) break;
+		/* the engine waits for its reads */
+		stats_phase(PHASE_READ);
+		ret = uring_submit_and_wait(&r, 1);
+		stats_phase(PHASE_NONE);
+		if (ret < 0) {
+			perror("io_uring_enter");
+			exit(EXIT_FAILURE);
+		}
+		while ((cqe = uring_peek_cqe(&r))) {
+			unsigned long long user_data = cqe->user_data;
+			int res = cqe->res;
+
+			uring_cqe_seen(&r);
+			slot = user_data >> 8;
+			if (uring_complete(&r, &files[slot], slot, user_data & 0xff, res)) {
+				uring_finish(&files[slot]);
+				--active;
+			}
+		}
+		if (uring_mb) active -= uring_hash_mb(&r, files);
+	}
+
+	for (slot = 0; slot < URING_FILES; ++slot) {
+		for (b = 0; b < URING_FILE_READS; ++b) free(files[slot].bufs[b]);
+	}
+	free(files);
+	uring_exit(&r);
+	return NULL;
+}
+
+static void start_workers(void)
+{
+	struct job_queue *q = &work_queue;
+	unsigned i;
+
+	if (option_uring) {
+		threaded = 1;
+		work_queue_limit = URING_FILES * JOB_QUEUE_FACTOR;
+		out_limit = work_queue_limit * OUT_QUEUE_FACTOR;
+		q = &archive_queue;
+		/* the engine reads worker_count */
+		worker_count = option_archives || option_partial ?
+		               (option_jobs > 1 ? option_jobs - 1 : 1) : 0;
+		if (pthread_create(&uring_thread, NULL, uring_main, NULL) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	} else if (option_jobs > 1) {
+		threaded = 1;
+		work_queue_limit = option_jobs * JOB_QUEUE_FACTOR;
+		out_limit = work_queue_limit * OUT_QUEUE_FACTOR;
+		worker_count = option_jobs;
+	}
+	if (!worker_count) return;
+	workers = (pthread_t *)malloc(worker_count * sizeof (pthread_t));
+	if (!workers) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < worker_count; ++i) {
+		if (pthread_create(&workers[i], NULL, worker_main, q) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* run j or queue it for the workers */
+static void queue_job(struct job *j)
+{
+	if (!threaded) {
+		__atomic_store_n(&j->started, now_ns(), __ATOMIC_RELAXED);
+		j->run(j);
+		j->done = 1;
+		flush_jobs(0);
+		return;
+	}
+
+	for (;;) {
+		flush_jobs(0);
+		pthread_mutex_lock(&job_mutex);
+		if (work_queue.count < work_queue_limit) break;
+		pthread_cond_wait(&done_cond, &job_mutex);
+		pthread_mutex_unlock(&job_mutex);
+	}
+	queue_push(&work_queue, j);
+	pthread_mutex_unlock(&job_mutex);
+}
+
+/* Hash jobs held back by -o, to be queued in the order of their data on
+ * disk. Their output slots are already in place, so the output keeps the
+ * traversal order. */
+static struct job **order_batch = NULL;
+static size_t order_batch_count = 0;
+static size_t order_batch_alloc = 0;
+
+/* the physical offset of the first extent of the file, its inode number
+ * when the file system does not tell */
+static unsigned long long get_disk_order(const char *filename, unsigned long long ino)
+{
+	union {
+		struct fiemap fm;
+		char buf[sizeof (struct fiemap) + sizeof (struct fiemap_extent)];
+	} m;
+	unsigned long long order = ino;
+	int fd = open(filename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+	if (fd < 0) return order;
+	memset(&m, 0, sizeof (m));
+	m.fm.fm_length = FIEMAP_MAX_OFFSET;
+	m.fm.fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, &m.fm) == 0) {
+		/* no extent, nothing to seek to */
+		order = 0;
+		if (m.fm.fm_mapped_extents &&
+		    !(m.fm.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+			order = m.fm.fm_extents[0].fe_physical;
+		}
+	}
+	close(fd);
+	return order;
+}
+
+static int cmp_disk_order(const void *a, const void *b)
+{
+	const struct job *ja = *(struct job * const *)a;
+	const struct job *jb = *(struct job * const *)b;
+
+	if (ja->key.dev != jb->key.dev) return ja->key.dev < jb->key.dev ? -1 : 1;
+	if (ja->disk_order != jb->disk_order) return ja->disk_order < jb->disk_order ? -1 : 1;
+	return 0;
+}
+
+static void flush_order_batch(void)
+{
+	size_t i;
+
+	if (!order_batch_count) return;
+	qsort(order_batch, order_batch_count, sizeof (struct job *), cmp_disk_order);
+	for (i = 0; i < order_batch_count; ++i) queue_job(order_batch[i]);
+	order_batch_count = 0;
+}
+
+static void add_order_batch(struct job *j)
+{
+	if (order_batch_count >= order_batch_alloc) {
+		size_t alloc = grow_size(order_batch_alloc);
+		struct job **t = (struct job **)realloc(order_batch, alloc * sizeof (struct job *));
+		if (!t) {
+			/* no room to wait */
+			queue_job(j);
+			return;
+		}
+		order_batch = t;
+		order_batch_alloc = alloc;
+	}
+	j->disk_order = get_disk_order(j->filename, j->key.ino);
+	order_batch[order_batch_count++] = j;
+	if (option_order_batch && order_batch_count >= option_order_batch) {
+		flush_order_batch();
+	}
+}
+
+static void stop_workers(void)
+{
+	unsigned i;
+
+	close_trav_job();
+	flush_order_batch();
+	free(order_batch);
+	order_batch = NULL;
+	order_batch_alloc = 0;
+	/* while the workers can still take the links flush_jobs queues */
+	if (threaded) flush_jobs(1);
+	queue_end(&work_queue);
+	if (option_uring) pthread_join(uring_thread, NULL);
+	queue_end(&archive_queue);
+	for (i = 0; i < worker_count; ++i) pthread_join(workers[i], NULL);
+	free(workers);
+	workers = NULL;
+	worker_count = 0;
+	threaded = 0;
+	sandbox_stop();
+	flush_jobs(1);
+}
+
+/* wait until the output slots in flight are under out_limit, so that a
+ * slow file does not keep the output of all the files after it in memory */
+static void wait_out_room(void)
+{
+	if (!threaded) return;
+	flush_jobs(0);
+	pthread_mutex_lock(&job_mutex);
+	while (out_count >= out_limit) {
+		if (order_batch_count) {
+			/* the first slot may be held back by -o */
+			pthread_mutex_unlock(&job_mutex);
+			flush_order_batch();
+		} else {
+			pthread_cond_wait(&done_cond, &job_mutex);
+			pthread_mutex_unlock(&job_mutex);
+		}
+		flush_jobs(0);
+		pthread_mutex_lock(&job_mutex);
+	}
+	pthread_mutex_unlock(&job_mutex);
+}
+
+static int add_link(struct job *j);
+
+int submit_file(const char *filename, const char *escaped_filename,
+                const struct stat *st, void (*run)(struct job *j))
+{
+	struct job *j;
+
+	close_trav_job();
+	wait_out_room();
+	j = add_job();
+	j->filename = strdup(filename);
+	j->escaped_filename = filename == escaped_filename ?
+		j->filename : strdup(escaped_filename);
+	j->run = run;
+	j->stat_size = st->st_size;
+	j->nlink = st->st_nlink;
+	set_file_key(&j->key, st);
+	if (!j->filename || !j->escaped_filename) {
+		print_error_line("job fail", strerror(errno), escaped_filename, &j->out);
+		j->done = 1;
+		flush_jobs(0);
+		return -1;
+	}
+
+	if (run == run_hash_job && j->nlink > 1 && add_link(j)) {
+		/* output from flush_link */
+		j->done = 1;
+		flush_jobs(0);
+	} else if (option_disk_order && run == run_hash_job) {
+		add_order_batch(j);
+	} else {
+		queue_job(j);
+	}
+	return 0;
+}
+
+/* Sizes of the regular files, collected before hashing with -s. Only
+ * files sharing their size with another one can have a duplicate. The
+ * members of archives are not counted, as their sizes are only known
+ * once the archives are read: their duplicates among the files are lost. */
+struct size_count {
+	unsigned long long size;
+	unsigned count;
+};
+
+static struct htable size_table = {
+	NULL, NULL, sizeof (struct size_count), sizeof (unsigned long long), 0, 0
+};
+
+static void count_size(unsigned long long size)
+{
+	struct size_count *sc =
+		(struct size_count *)htable_insert(&size_table, &size, NULL);
+
+	if (!sc) {
+		perror("htable_insert");
+		exit(EXIT_FAILURE);
+	}
+	if (sc->count < 2) ++sc->count;
+}
+
+static int is_unique_size(unsigned long long size)
+{
+	const struct size_count *sc =
+		(const struct size_count *)htable_find(&size_table, &size);
+
+	return !sc || sc->count < 2;
+}
+
+static void count_size_file(const char *filename, const struct stat *st)
+{
+	(void)filename;
+	count_size(st->st_size);
+}
+
+/* -E totals of what is to be hashed, for the progress reports */
+static void count_total_file(const char *filename, const struct stat *st)
+{
+	(void)filename;
+	if (option_size_filter && is_unique_size(st->st_size)) return;
+	stats_add(&stats->total_files, 1);
+	stats_add(&stats->total_bytes, st->st_size);
+}
+
+/* Head and tail digests, computed with -p for the files that do not have a
+ * unique size. Only files sharing their size and partial digest with
+ * another one are fully hashed. */
+struct partial_inode {
+	unsigned long long dev;
+	unsigned long long ino;
+	unsigned char digest[MAX_DIGEST_LENGTH];
+	int valid;
+};
+
+struct partial_count {
+	unsigned long long size;
+	unsigned char digest[MAX_DIGEST_LENGTH];
+	unsigned count;
+};
+
+static pthread_mutex_t partial_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct htable partial_inode_table = {
+	NULL, NULL, sizeof (struct partial_inode), 2 * sizeof (unsigned long long), 0, 0
+};
+static struct htable partial_count_table = {
+	NULL, NULL, sizeof (struct partial_count),
+	sizeof (unsigned long long) + MAX_DIGEST_LENGTH, 0, 0
+};
+
+static int partial_digest(int fd, unsigned long long size, unsigned char *digest)
+{
+	struct xhash c;
+	unsigned long long pos = 0;
+	void *buf;
+	int phase, update_ret;
+	int ret = -1;
+
+	if (!(buf = malloc(PARTIAL_SIZE))) return -1;
+	stats_add(&stats->files, 1);
+	if (xhash_init(&c) != 0) goto end;
+	while (pos < size) {
+		size_t size_to_read = PARTIAL_SIZE;
+		unsigned long long start;
+		ssize_t rsize;
+
+		if (pos == PARTIAL_SIZE && size - pos > PARTIAL_SIZE) {
+			pos = size - PARTIAL_SIZE;
+		}
+		if (size - pos < size_to_read) size_to_read = size - pos;
+		start = throttle_read(size_to_read);
+		phase = stats_phase(PHASE_READ);
+		rsize = pread(fd, buf, size_to_read, pos);
+		stats_phase(phase);
+		throttle_read_end(start);
+		if (rsize < 0 && errno == EINTR) continue;
+		if (rsize <= 0) break;
+		stats_add(&stats->bytes, rsize);
+		phase = stats_phase(PHASE_HASH);
+		update_ret = xhash_update(&c, buf, rsize);
+		stats_phase(phase);
+		if (update_ret != 0) break;
+		pos += rsize;
+	}
+	if (xhash_final(&c, digest) == 0 && pos == size) ret = 0;
+end:
+	free(buf);
+	return ret;
+}
+
+static void run_partial_job(struct job *j)
+{
+	struct partial_inode key;
+	struct partial_inode *pi;
+	struct partial_count count_key;
+	struct partial_count *pc;
+	unsigned char digest[MAX_DIGEST_LENGTH];
+	int valid = 0;
+	int fd;
+
+	/* the table keys hold the whole array, past the digest length too */
+	memset(digest, 0, sizeof (digest));
+	memset(&key, 0, sizeof (key));
+	key.dev = j->key.dev;
+	key.ino = j->key.ino;
+	pthread_mutex_lock(&partial_mutex);
+	pi = (struct partial_inode *)htable_find(&partial_inode_table, &key);
+	if (pi) {
+		valid = pi->valid;
+		memcpy(digest, pi->digest, MAX_DIGEST_LENGTH);
+	}
+	pthread_mutex_unlock(&partial_mutex);
+	if (!pi) {
+		throttle_file();
+		if ((fd = open(j->filename, O_RDONLY)) >= 0) {
+			valid = partial_digest(fd, j->stat_size, digest) == 0;
+			close(fd);
+		}
+	}
+
+	pthread_mutex_lock(&partial_mutex);
+	pi = (struct partial_inode *)htable_insert(&partial_inode_table, &key, NULL);
+	if (pi) {
+		pi->valid = valid;
+		if (valid) memcpy(pi->digest, digest, MAX_DIGEST_LENGTH);
+	}
+	if (valid) {
+		memset(&count_key, 0, sizeof (count_key));
+		count_key.size = j->stat_size;
+		memcpy(count_key.digest, digest, MAX_DIGEST_LENGTH);
+		pc = (struct partial_count *)htable_insert(&partial_count_table, &count_key, NULL);
+		if (pc && pc->count < 2) ++pc->count;
+	}
+	pthread_mutex_unlock(&partial_mutex);
+	if (!pi) {
+		perror("htable_insert");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void submit_partial_file(const char *filename, const struct stat *st)
+{
+	if (option_size_filter && is_unique_size(st->st_size)) return;
+	submit_file(filename, filename, st, run_partial_job);
+}
+
+static int is_unique_partial(const struct stat *st)
+{
+	struct partial_inode key;
+	const struct partial_inode *pi;
+	struct partial_count count_key;
+	const struct partial_count *pc;
+
+	memset(&key, 0, sizeof (key));
+	key.dev = st->st_dev;
+	key.ino = st->st_ino;
+	pi = (const struct partial_inode *)htable_find(&partial_inode_table, &key);
+	/* unreadable or changed since: let the hashing pass report it */
+	if (!pi || !pi->valid) return 0;
+	memset(&count_key, 0, sizeof (count_key));
+	count_key.size = st->st_size;
+	memcpy(count_key.digest, pi->digest, MAX_DIGEST_LENGTH);
+	pc = (const struct partial_count *)htable_find(&partial_count_table, &count_key);
+	return !pc || pc->count < 2;
+}
+
+/* reason not to read a regular file, NULL if it must be hashed */
+static const char *get_unread_reason(const struct stat *st)
+{
+	if (option_size_filter && is_unique_size(st->st_size)) return "unique size";
+	if (option_partial && is_unique_partial(st)) return "unique partial";
+	return NULL;
+}
+
+int sort_str(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Entries of a directory, read with getdents64 and packed in one arena
+ * as a d_type byte followed by the NUL terminated name. names points to
+ * the names in the arena. */
+struct dir_list {
+	char *arena;
+	size_t len;
+	size_t size;
+	char **names;
+	size_t count;
+	size_t max_name_len;
+};
+
+struct linux_dirent64 {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* directories held open by the traversal, past MAX_DIR_FDS the entries
+ * of a directory are reached by their full path */
+static unsigned dir_fds = 0;
+
+static int dir_list_add(struct dir_list *dl, unsigned char type,
+                        const char *name, size_t name_len)
+{
+	if (dl->len + 1 + name_len + 1 > dl->size) {
+		size_t size = dl->size;
+		char *t;
+		while (dl->len + 1 + name_len + 1 > size) size = grow_size(size);
+		if (!(t = (char *)realloc(dl->arena, size))) return -1;
+		dl->arena = t;
+		dl->size = size;
+	}
+	dl->arena[dl->len] = type;
+	memcpy(dl->arena + dl->len + 1, name, name_len + 1);
+	dl->len += 1 + name_len + 1;
+	return 0;
+}
+
+/* index the names of the arena, sorted if sort */
+static int dir_list_index(struct dir_list *dl, int sort)
+{
+	const char *p, *end = dl->arena + dl->len;
+	size_t count = 0;
+
+	for (p = dl->arena; p < end; p += 1 + strlen(p + 1) + 1) ++count;
+	dl->count = 0;
+	dl->max_name_len = 0;
+	if (!count) return 0;
+	if (!(dl->names = (char **)malloc(count * sizeof (char *)))) return -1;
+	for (p = dl->arena; p < end; ) {
+		size_t name_len = strlen(p + 1);
+		dl->names[dl->count++] = (char *)p + 1;
+		if (name_len > dl->max_name_len) dl->max_name_len = name_len;
+		p += 1 + name_len + 1;
+	}
+	if (sort) qsort(dl->names, dl->count, sizeof (char *), sort_str);
+	return 0;
+}
+
+static int dir_list_read(int fd, struct dir_list *dl, int sort)
+{
+	char *buf;
+	long n;
+	int phase;
+
+	if (!(buf = (char *)malloc(DENTS_SIZE))) return -1;
+	phase = stats_phase(PHASE_STAT);
+	while ((n = syscall(SYS_getdents64, fd, buf, DENTS_SIZE)) > 0) {
+		long pos;
+		for (pos = 0; pos < n; ) {
+			struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+			pos += d->d_reclen;
+			if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) continue;
+			if (dir_list_add(dl, d->d_type, d->d_name, strlen(d->d_name)) != 0) {
+				stats_phase(phase);
+				free(buf);
+				return -1;
+			}
+		}
+	}
+	stats_phase(phase);
+	free(buf);
+	if (n < 0) return -1;
+	return dir_list_index(dl, sort);
+}
+
+static void dir_list_free(struct dir_list *dl)
+{
+	free(dl->arena);
+	free(dl->names);
+	memset(dl, 0, sizeof (*dl));
+}
+
+static int open_dir_at(int dirfd, const char *name)
+{
+	int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+	if (fd >= 0) ++dir_fds;
+	return fd;
+}
+
+/* once its entries are read, let go of fd if too many are open */
+static int release_dir(int fd)
+{
+	if (fd >= 0 && dir_fds > MAX_DIR_FDS) {
+		close(fd);
+		--dir_fds;
+		return AT_FDCWD;
+	}
+	return fd;
+}
+
+static void close_dir(int fd)
+{
+	if (fd >= 0) {
+		close(fd);
+		--dir_fds;
+	}
+}
+
+/* path buffer for the entries of directory filename, the name of an entry
+ * is written at the returned offset */
+static char *dir_path(const char *filename, const struct dir_list *dl, size_t *name_off)
+{
+	size_t filename_len = strlen(filename);
+	char *path = (char *)malloc(filename_len + 1 + dl->max_name_len + 1);
+
+	if (!path) return NULL;
+	memcpy(path, filename, filename_len);
+	path[filename_len] = '/';
+	*name_off = filename_len + 1;
+	return path;
+}
+
+/* whether the traversal needs to stat an entry of type d_type: the type
+ * alone is enough for anything but regular files, and for directories
+ * when there is no cache */
+static int needs_stat(unsigned char d_type)
+{
+	return d_type == DT_UNKNOWN || d_type == DT_REG ||
+	       (d_type == DT_DIR && option_cache) || option_inode;
+}
+
+/* Parallel traversal (-t): on file systems where each metadata operation
+ * is a network round trip, a pool of threads reads the directories and
+ * stats their entries ahead of the traversal. Each directory is a task,
+ * queued on the deque of the thread which found it, its subdirectories
+ * in front. A deque is thus in the order of the traversal: a thread takes
+ * the first task of its own deque and, when it runs out, steals the first
+ * task of another one, starting with the main thread's. Every task is a
+ * single directory, so what is stolen next matters more than its size.
+ * The traversal itself stays on the main thread and consumes the results
+ * in its sorted order, running a task itself when no thread has taken
+ * it yet, so the output is the same as without -t. At most about
+ * TRAV_MAX_AHEAD entries are held for it. */
+struct trav_stat {
+	int stat_errno; /* -1 when the entry was not stat'ed */
+	struct stat st;
+	struct trav_dir *dir;
+};
+
+#define TRAV_QUEUED 0
+#define TRAV_RUNNING 1
+#define TRAV_DONE 2
+
+struct trav_dir {
+	struct trav_dir *prev;
+	struct trav_dir *next;
+	unsigned deque;
+	int state;
+	int dropped;
+	int error;
+	char *path;
+	/* with the cache, the stat of the directory if known, and whether
+	 * its entries came from the cache */
+	int has_st;
+	int cached;
+	struct stat st;
+	struct dir_list dl;
+	struct trav_stat *stats;
+};
+
+struct trav_deque {
+	struct trav_dir *first;
+	struct trav_dir *last;
+};
+
+static pthread_mutex_t trav_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trav_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t trav_done_cond = PTHREAD_COND_INITIALIZER;
+/* deque 0 is the main thread's */
+static struct trav_deque *trav_deques = NULL;
+static pthread_t *trav_threads = NULL;
+static size_t trav_ahead = 0;
+static int trav_end = 0;
+
+static struct trav_dir *trav_new(const char *path, size_t path_len)
+{
+	struct trav_dir *td = (struct trav_dir *)calloc(1, sizeof (struct trav_dir));
+
+	if (!td) return NULL;
+	if (!(td->path = (char *)malloc(path_len + 1))) {
+		free(td);
+		return NULL;
+	}
+	memcpy(td->path, path, path_len);
+	td->path[path_len] = '\0';
+	return td;
+}
+
+/* trav_mutex must be held, td goes in front of deque */
+static void trav_push(unsigned deque, struct trav_dir *td)
+{
+	struct trav_deque *d = &trav_deques[deque];
+
+	td->deque = deque;
+	td->prev = NULL;
+	td->next = d->first;
+	if (d->first) {
+		d->first->prev = td;
+	} else {
+		d->last = td;
+	}
+	d->first = td;
+	pthread_cond_signal(&trav_cond);
+}
+
+/* trav_mutex must be held */
+static void trav_unlink(struct trav_dir *td)
+{
+	struct trav_deque *d = &trav_deques[td->deque];
+
+	if (td->prev) {
+		td->prev->next = td->next;
+	} else {
+		d->first = td->next;
+	}
+	if (td->next) {
+		td->next->prev = td->prev;
+	} else {
+		d->last = td->prev;
+	}
+}
+
+/* trav_mutex must be held, the first task of deque or else of another
+ * deque */
+static struct trav_dir *trav_take(unsigned deque)
+{
+	struct trav_dir *td;
+	unsigned i;
+
+	if ((td = trav_deques[deque].first)) {
+		trav_unlink(td);
+		return td;
+	}
+	for (i = 0; i <= option_trav_threads; ++i) {
+		if ((td = trav_deques[i].first)) {
+			trav_unlink(td);
+			return td;
+		}
+	}
+	return NULL;
+}
+
+static int cache_read_dir(const struct stat *st, struct dir_list *dl);
+
+/* read the entries of td and stat the ones the traversal will need */
+static void trav_read(struct trav_dir *td)
+{
+	size_t path_len = strlen(td->path);
+	size_t i;
+	int fd = open(td->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+	if (fd < 0) {
+		td->error = errno;
+		return;
+	}
+	if (td->has_st && cache_read_dir(&td->st, &td->dl) == 0) {
+		td->cached = 1;
+	} else {
+		dir_list_free(&td->dl);
+		if (dir_list_read(fd, &td->dl, 1) != 0) goto bad_dir;
+	}
+	if (td->dl.count &&
+	    !(td->stats = (struct trav_stat *)calloc(td->dl.count, sizeof (struct trav_stat)))) {
+		goto bad_dir;
+	}
+	for (i = 0; i < td->dl.count; ++i) {
+		struct trav_stat *ts = &td->stats[i];
+		const char *name = td->dl.names[i];
+		unsigned char d_type = name[-1];
+		int is_dir = d_type == DT_DIR;
+
+		ts->stat_errno = -1;
+		if (needs_stat(d_type)) {
+			ts->stat_errno = fstatat(fd, name, &ts->st, AT_SYMLINK_NOFOLLOW) != 0 ? errno : 0;
+			is_dir = ts->stat_errno == 0 && S_ISDIR(ts->st.st_mode);
+		}
+		if (is_dir) {
+			/* without it, the traversal reads the directory itself */
+			size_t name_len = strlen(name);
+			char *path = (char *)malloc(path_len + 1 + name_len);
+			if (!path) continue;
+			memcpy(path, td->path, path_len);
+			path[path_len] = '/';
+			memcpy(path + path_len + 1, name, name_len);
+			ts->dir = trav_new(path, path_len + 1 + name_len);
+			free(path);
+			if (ts->dir && option_cache && ts->stat_errno == 0) {
+				ts->dir->has_st = 1;
+				ts->dir->st = ts->st;
+			}
+		}
+	}
+	close(fd);
+	return;
+bad_dir:
+	td->error = errno;
+	dir_list_free(&td->dl);
+	close(fd);
+}
+
+static void trav_drop(struct trav_dir *td);
+
+/* trav_mutex must be held */
+static void trav_free(struct trav_dir *td)
+{
+	size_t i;
+
+	for (i = 0; td->stats && i < td->dl.count; ++i) {
+		if (td->stats[i].dir) trav_drop(td->stats[i].dir);
+	}
+	if (td->state == TRAV_DONE) trav_ahead -= td->dl.count;
+	pthread_cond_broadcast(&trav_cond);
+	dir_list_free(&td->dl);
+	free(td->stats);
+	free(td->path);
+	free(td);
+}
+
+/* trav_mutex must be held, td will not be consumed */
+static void trav_drop(struct trav_dir *td)
+{
+	if (td->state == TRAV_RUNNING) {
+		td->dropped = 1;
+		return;
+	}
+	if (td->state == TRAV_QUEUED) trav_unlink(td);
+	trav_free(td);
+}
+
+/* run td taken from the deques by the thread of deque */
+static void trav_run(unsigned deque, struct trav_dir *td)
+{
+	size_t i;
+	int phase;
+
+	td->state = TRAV_RUNNING;
+	pthread_mutex_unlock(&trav_mutex);
+	phase = stats_phase(PHASE_STAT);
+	trav_read(td);
+	stats_phase(phase);
+	pthread_mutex_lock(&trav_mutex);
+	td->state = TRAV_DONE;
+	trav_ahead += td->dl.count;
+	pthread_cond_broadcast(&trav_done_cond);
+	if (td->dropped) {
+		trav_free(td);
+		return;
+	}
+	/* the first subdirectory is the next one taken */
+	for (i = td->dl.count; i-- > 0; ) {
+		if (td->stats[i].dir) trav_push(deque, td->stats[i].dir);
+	}
+}
+
+static void *trav_main(void *arg)
+{
+	unsigned deque = (unsigned)(size_t)arg;
+	struct trav_dir *td;
+
+	pthread_mutex_lock(&trav_mutex);
+	for (;;) {
+		td = NULL;
+		while (!trav_end && (trav_ahead > TRAV_MAX_AHEAD || !(td = trav_take(deque)))) {
+			pthread_cond_wait(&trav_cond, &trav_mutex);
+		}
+		if (!td) break;
+		trav_run(deque, td);
+	}
+	pthread_mutex_unlock(&trav_mutex);
+	return NULL;
+}
+
+static void trav_start(void)
+{
+	size_t i;
+
+	if (!option_trav_threads) return;
+	trav_deques = (struct trav_deque *)calloc(option_trav_threads + 1, sizeof (struct trav_deque));
+	trav_threads = (pthread_t *)malloc(option_trav_threads * sizeof (pthread_t));
+	if (!trav_deques || !trav_threads) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < option_trav_threads; ++i) {
+		if (pthread_create(&trav_threads[i], NULL, trav_main, (void *)(i + 1)) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void trav_stop(void)
+{
+	unsigned i;
+
+	if (!option_trav_threads) return;
+	pthread_mutex_lock(&trav_mutex);
+	trav_end = 1;
+	pthread_cond_broadcast(&trav_cond);
+	pthread_mutex_unlock(&trav_mutex);
+	for (i = 0; i < option_trav_threads; ++i) pthread_join(trav_threads[i], NULL);
+	free(trav_threads);
+	free(trav_deques);
+	trav_threads = NULL;
+	trav_deques = NULL;
+}
+
+/* the task of the directory path, NULL without -t; st is only needed
+ * with the cache */
+static struct trav_dir *trav_submit(const char *path, const struct stat *st)
+{
+	struct trav_dir *td;
+
+	if (!option_trav_threads || !(td = trav_new(path, strlen(path)))) return NULL;
+	if (option_cache && st) {
+		td->has_st = 1;
+		td->st = *st;
+	}
+	pthread_mutex_lock(&trav_mutex);
+	trav_push(0, td);
+	pthread_mutex_unlock(&trav_mutex);
+	return td;
+}
+
+/* wait for the entries of td, 0 when they could be read */
+static int trav_wait(struct trav_dir *td)
+{
+	pthread_mutex_lock(&trav_mutex);
+	if (td->state == TRAV_QUEUED) {
+		trav_unlink(td);
+		trav_run(0, td);
+	}
+	while (td->state != TRAV_DONE) pthread_cond_wait(&trav_done_cond, &trav_mutex);
+	pthread_mutex_unlock(&trav_mutex);
+	if (td->error) {
+		errno = td->error;
+		return -1;
+	}
+	return 0;
+}
+
+/* the task of the directory entry ts, now to be released by the caller */
+static struct trav_dir *trav_take_dir(struct trav_stat *ts)
+{
+	struct trav_dir *td = ts ? ts->dir : NULL;
+
+	if (ts) ts->dir = NULL;
+	return td;
+}
+
+static void trav_release(struct trav_dir *td)
+{
+	pthread_mutex_lock(&trav_mutex);
+	trav_free(td);
+	pthread_mutex_unlock(&trav_mutex);
+}
+
+/* metadata only walk calling fn for each regular file, errors are
+ * reported by the hashing pass */
+static void walk_files_at(int dirfd, const char *name, const char *filename,
+                          unsigned char d_type, struct trav_stat *ts,
+                          void (*fn)(const char *filename, const struct stat *st))
+{
+	struct stat st;
+	struct dir_list dl;
+	struct trav_dir *td = trav_take_dir(ts);
+	size_t name_off, i;
+	char *path;
+	int fd;
+
+	if (ts && ts->stat_errno >= 0) {
+		if (ts->stat_errno == 0 && S_ISREG(ts->st.st_mode)) fn(filename, &ts->st);
+		if (ts->stat_errno != 0 || !S_ISDIR(ts->st.st_mode)) {
+			if (td) trav_release(td);
+			return;
+		}
+	} else if (d_type == DT_UNKNOWN || d_type == DT_REG) {
+		int phase = stats_phase(PHASE_STAT);
+		int ret = fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+
+		stats_phase(phase);
+		if (ret != 0) return;
+		if (S_ISREG(st.st_mode)) {
+			fn(filename, &st);
+			return;
+		}
+		if (!S_ISDIR(st.st_mode)) return;
+	} else if (d_type != DT_DIR) {
+		return;
+	}
+	if (td || (td = trav_submit(filename, NULL))) {
+		if (trav_wait(td) == 0 && (path = dir_path(filename, &td->dl, &name_off))) {
+			for (i = 0; i < td->dl.count; ++i) {
+				strcpy(path + name_off, td->dl.names[i]);
+				walk_files_at(AT_FDCWD, path, path, td->dl.names[i][-1],
+				              &td->stats[i], fn);
+			}
+			free(path);
+		}
+		trav_release(td);
+		return;
+	}
+	if ((fd = open_dir_at(dirfd, name)) < 0) return;
+	memset(&dl, 0, sizeof (dl));
+	if (dir_list_read(fd, &dl, 0) == 0 && (path = dir_path(filename, &dl, &name_off))) {
+		fd = release_dir(fd);
+		for (i = 0; i < dl.count; ++i) {
+			strcpy(path + name_off, dl.names[i]);
+			walk_files_at(fd, fd == AT_FDCWD ? path : dl.names[i], path,
+			              dl.names[i][-1], NULL, fn);
+		}
+		free(path);
+	}
+	dir_list_free(&dl);
+	close_dir(fd);
+}
+
+static void walk_files(const char *filename,
+                       void (*fn)(const char *filename, const struct stat *st))
+{
+	walk_files_at(AT_FDCWD, filename, filename, DT_UNKNOWN, NULL, fn);
+}
+
+/* Persistent cache (-c) of the output of regular files and of the sorted
+ * entry names of directories, keyed by their metadata, so that a rescan
+ * only reads what changed. In file records the file name is replaced by
+ * a NUL byte on each line. Archive listings (-a) are keyed by the digest
+ * of the archive instead, with an empty entry for the size of each, so
+ * that only the archives that may hit are hashed before being listed.
+ * Only the entries seen during the run are written back. */
+struct cache_key {
+	unsigned long long type;
+	union {
+		struct file_key fk;
+		unsigned char digest[MAX_DIGEST_LENGTH];
+		unsigned long long size;
+	} u;
+};
+
+struct cache_entry {
+	struct cache_key key;
+	char *data;
+	size_t len;
+	int seen;
+	int owned;
+};
+
+#define CACHE_FILE 1
+#define CACHE_DIR 2
+#define CACHE_LIST 3
+#define CACHE_LIST_SIZE 4
+#define CACHE_MAGIC "xmd5 cache 3\n"
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct htable cache_table = {
+	NULL, NULL, sizeof (struct cache_entry), sizeof (struct cache_key), 0, 0
+};
+static void *cache_map = NULL;
+static size_t cache_map_size = 0;
+
+static void set_cache_key(struct cache_key *k, unsigned type, const struct stat *st)
+{
+	memset(k, 0, sizeof (*k));
+	k->type = type;
+	set_file_key(&k->u.fk, st);
+}
+
+/* what the outputs in the cache depend on, after its magic: the hash,
+ * and whether and which archives are listed, and how deep */
+static void cache_options(char *buf, size_t size)
+{
+	int len = snprintf(buf, size, "%s", hash_algos[option_hash].name);
+
+	if (!option_archives) {
+		snprintf(buf + len, size - len, " n");
+		return;
+	}
+	if (option_all_archives) len += snprintf(buf + len, size - len, " A");
+	if (option_nest_depth) snprintf(buf + len, size - len, " r%u", option_nest_depth);
+}
+
+static int cache_load(const char *filename)
+{
+	struct stat st;
+	const char *p, *end;
+	char options[64];
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) return errno == ENOENT ? 0 : -1;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)strlen(CACHE_MAGIC)) {
+		close(fd);
+		return -1;
+	}
+	cache_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache_map == MAP_FAILED) {
+		cache_map = NULL;
+		return -1;
+	}
+	cache_map_size = st.st_size;
+	p = (const char *)cache_map;
+	end = p + cache_map_size;
+	if (memcmp(p, CACHE_MAGIC, strlen(CACHE_MAGIC)) != 0) return -1;
+	p += strlen(CACHE_MAGIC);
+	/* digests of another algorithm, or outputs listing other archives,
+	 * are of no use */
+	cache_options(options, sizeof (options));
+	if ((size_t)(end - p) < strlen(options) + 1 ||
+	    memcmp(p, options, strlen(options)) != 0 || p[strlen(options)] != '\n') return -1;
+	p += strlen(options) + 1;
+	while ((size_t)(end - p) >= sizeof (struct cache_key) + sizeof (unsigned long long)) {
+		struct cache_key key;
+		struct cache_entry *ce;
+		unsigned long long len;
+
+		memcpy(&key, p, sizeof (key));
+		memcpy(&len, p + sizeof (key), sizeof (len));
+		p += sizeof (key) + sizeof (len);
+		if (len > (size_t)(end - p)) break;
+		if (!(ce = (struct cache_entry *)htable_insert(&cache_table, &key, NULL))) return -1;
+		ce->data = (char *)p;
+		ce->len = len;
+		p += len;
+	}
+	return 0;
+}
+
+/* all: the entries not seen in this run too */
+static int cache_save(const char *filename, int all)
+{
+	char *tmp_filename;
+	char options[64];
+	FILE *f;
+	size_t i;
+	int ret = 0;
+
+	if (!(tmp_filename = (char *)malloc(strlen(filename) + 5))) return -1;
+	sprintf(tmp_filename, "%s.tmp", filename);
+	if (!(f = fopen(tmp_filename, "wb"))) {
+		free(tmp_filename);
+		return -1;
+	}
+	cache_options(options, sizeof (options));
+	fprintf(f, "%s%s\n", CACHE_MAGIC, options);
+	pthread_mutex_lock(&cache_mutex);
+	for (i = 0; i < cache_table.alloc_size; ++i) {
+		const struct cache_entry *ce =
+			(const struct cache_entry *)(cache_table.recs + i * cache_table.rec_size);
+		unsigned long long len = ce->len;
+		if (!cache_table.used[i] || !(ce->seen || all)) continue;
+		fwrite(&ce->key, sizeof (ce->key), 1, f);
+		fwrite(&len, sizeof (len), 1, f);
+		fwrite(ce->data, 1, ce->len, f);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	if (ferror(f)) ret = -1;
+	if (fclose(f) != 0) ret = -1;
+	if (ret == 0 && rename(tmp_filename, filename) != 0) ret = -1;
+	if (ret != 0) unlink(tmp_filename);
+	free(tmp_filename);
+	return ret;
+}
+
+/* on a resume, the entries seen by the interrupted run are all kept, as
+ * the traversal skips them */
+static void cache_see_all(void)
+{
+	size_t i;
+
+	for (i = 0; i < cache_table.alloc_size; ++i) {
+		struct cache_entry *ce =
+			(struct cache_entry *)(cache_table.recs + i * cache_table.rec_size);
+		if (cache_table.used[i]) ce->seen = 1;
+	}
+}
+
+static void cache_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < cache_table.alloc_size; ++i) {
+		struct cache_entry *ce =
+			(struct cache_entry *)(cache_table.recs + i * cache_table.rec_size);
+		if (cache_table.used[i] && ce->owned) free(ce->data);
+	}
+	htable_free(&cache_table);
+	if (cache_map) munmap(cache_map, cache_map_size);
+	cache_map = NULL;
+}
+
+/* data of a cache entry, marking it as seen */
+static const char *cache_get(const struct cache_key *key, size_t *len)
+{
+	struct cache_entry *ce;
+	const char *data = NULL;
+
+	pthread_mutex_lock(&cache_mutex);
+	if ((ce = (struct cache_entry *)htable_find(&cache_table, key))) {
+		ce->seen = 1;
+		data = ce->data;
+		*len = ce->len;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	return data;
+}
+
+/* takes ownership of data */
+static void cache_put(const struct cache_key *key, char *data, size_t len)
+{
+	struct cache_entry *ce;
+
+	pthread_mutex_lock(&cache_mutex);
+	if ((ce = (struct cache_entry *)htable_insert(&cache_table, key, NULL))) {
+		if (ce->owned) free(ce->data);
+		ce->data = data;
+		ce->len = len;
+		ce->seen = 1;
+		ce->owned = 1;
+	} else {
+		free(data);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/* write output stripped by strip_name with escaped_filename as name */
+static void expand_name(const char *data, size_t len,
+                        const char *escaped_filename, struct xbuf *out)
+{
+	const char *p, *end;
+
+	for (p = data, end = data + len; p < end; ) {
+		const char *name_p = (const char *)memchr(p, '\0', end - p);
+		if (!name_p) name_p = end;
+		xbuf_write(out, p, name_p - p);
+		if (name_p < end) xbuf_write(out, escaped_filename, strlen(escaped_filename));
+		p = name_p + 1;
+	}
+}
+
+/* write the cached output of a regular file, 0 on a hit */
+static int cache_output_file(const struct stat *st, const char *escaped_filename,
+                             struct xbuf *out)
+{
+	struct cache_key key;
+	const char *data;
+	size_t len;
+
+	set_cache_key(&key, CACHE_FILE, st);
+	if (!(data = cache_get(&key, &len))) return -1;
+	expand_name(data, len, escaped_filename, out);
+	return 0;
+}
+
+/* the file name field of a listing line */
+static int is_hash_line(const char *line)
+{
+	const struct hash_algo *algo = &hash_algos[option_hash];
+	size_t i;
+
+	if (strncmp(line, algo->tag, strlen(algo->tag)) != 0) return 0;
+	line += strlen(algo->tag);
+	for (i = 0; i < algo->digest_length * 2; ++i) {
+		if (!((line[i] >= '0' && line[i] <= '9') ||
+		      (line[i] >= 'a' && line[i] <= 'f'))) return 0;
+	}
+	return line[i] == ' ';
+}
+
+/* lines with the file name replaced by a NUL byte, NULL if one of them
+ * is not about escaped_filename */
+static char *strip_lines(const char *lines, size_t lines_len,
+                         const char *escaped_filename, size_t *len)
+{
+	size_t name_len = strlen(escaped_filename);
+	const char *p, *end;
+	char *data, *dp;
+
+	if (!(data = (char *)malloc(lines_len ? lines_len : 1))) return NULL;
+	dp = data;
+	for (p = lines, end = lines + lines_len; p < end; ) {
+		const char *name_p = get_name_field(p);
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		if (!eol || !name_p || name_p > eol ||
+		    (size_t)(eol - name_p) < name_len ||
+		    memcmp(name_p, escaped_filename, name_len) != 0) {
+			free(data);
+			return NULL;
+		}
+		memcpy(dp, p, name_p - p);
+		dp += name_p - p;
+		*dp++ = '\0';
+		memcpy(dp, name_p + name_len, eol + 1 - (name_p + name_len));
+		dp += eol + 1 - (name_p + name_len);
+		p = eol + 1;
+	}
+	*len = dp - data;
+	return data;
+}
+
+/* the output of a successful hash job stripped of the file name, NULL if
+ * it is not one */
+static char *strip_name(const struct job *j, size_t *len)
+{
+	/* a listing too large to hold is not kept */
+	if (j->spill || !j->out.len || !is_hash_line(j->out.data)) return NULL;
+	return strip_lines(j->out.data, j->out.len, j->escaped_filename, len);
+}
+
+/* the digest of a line accepted by is_hash_line */
+static void get_line_digest(const char *line, unsigned char *digest)
+{
+	const struct hash_algo *algo = &hash_algos[option_hash];
+	size_t i;
+
+	line += strlen(algo->tag);
+	for (i = 0; i < algo->digest_length * 2; ++i) {
+		unsigned v = line[i] <= '9' ? line[i] - '0' : line[i] - 'a' + 10;
+		if (i % 2 == 0) {
+			digest[i / 2] = v << 4;
+		} else {
+			digest[i / 2] |= v;
+		}
+	}
+}
+
+static int set_list_key(struct cache_key *k, const struct job *j)
+{
+	if (j->spill || !j->out.len || !is_hash_line(j->out.data)) return -1;
+	memset(k, 0, sizeof (*k));
+	k->type = CACHE_LIST;
+	get_line_digest(j->out.data, k->u.digest);
+	return 0;
+}
+
+static void set_list_size_key(struct cache_key *k, const struct job *j)
+{
+	memset(k, 0, sizeof (*k));
+	k->type = CACHE_LIST_SIZE;
+	k->u.size = j->stat_size;
+}
+
+/* whether a listing of an archive of the size of j is cached */
+static int list_cache_probe(const struct job *j)
+{
+	struct cache_key key;
+	size_t len;
+
+	set_list_size_key(&key, j);
+	return cache_get(&key, &len) != NULL;
+}
+
+/* append the listing of an archive with the same content, 0 on a hit */
+static int list_cache_output(struct job *j)
+{
+	struct cache_key key;
+	const char *data;
+	size_t len;
+
+	if (set_list_key(&key, j) != 0) return -1;
+	if (!(data = cache_get(&key, &len))) return -1;
+	expand_name(data, len, j->escaped_filename, &j->out);
+	return 0;
+}
+
+/* store the lines after the hash line, empty if it is not an archive */
+static void list_cache_store(const struct job *j)
+{
+	struct cache_key key;
+	const char *alist;
+	char *data;
+	size_t len;
+
+	if (set_list_key(&key, j) != 0) return;
+	alist = (const char *)memchr(j->out.data, '\n', j->out.len);
+	if (!alist++) return;
+	if (!(data = strip_lines(alist, j->out.data + j->out.len - alist,
+	                         j->escaped_filename, &len))) return;
+	cache_put(&key, data, len);
+	set_list_size_key(&key, j);
+	if ((data = (char *)malloc(1))) cache_put(&key, data, 0);
+}
+
+/* store the output of a successful hash job */
+static void cache_store_file(const struct job *j)
+{
+	struct cache_key key;
+	char *data;
+	size_t len;
+
+	if (!(data = strip_name(j, &len))) return;
+	memset(&key, 0, sizeof (key));
+	key.type = CACHE_FILE;
+	key.u.fk = j->key;
+	cache_put(&key, data, len);
+}
+
+/* Regular files with more than one name. The first name is hashed, and
+ * its output is kept, stripped of the name, until all the other names
+ * have reused it. Only the main thread uses the table. */
+struct link_entry {
+	struct file_key key;
+	char *data;
+	size_t len;
+	unsigned long long names_left;
+};
+
+static struct htable link_table = {
+	NULL, NULL, sizeof (struct link_entry), sizeof (struct file_key), 0, 0
+};
+
+/* 1 if j is a later name of a file already submitted */
+static int add_link(struct job *j)
+{
+	int created;
+	struct link_entry *le =
+		(struct link_entry *)htable_insert(&link_table, &j->key, &created);
+
+	if (!le) return 0;
+	if (created) {
+		le->names_left = j->nlink;
+		return 0;
+	}
+	j->link = 1;
+	return 1;
+}
+
+/* whether the names before the one of j, a link, could not be hashed */
+static int link_unhashed(const struct job *j)
+{
+	struct link_entry *le =
+		(struct link_entry *)htable_find(&link_table, &j->key);
+
+	return le && !le->data;
+}
+
+/* called in output order, so the first name comes before the others */
+static void flush_link(struct job *j)
+{
+	struct link_entry *le =
+		(struct link_entry *)htable_find(&link_table, &j->key);
+
+	if (!le) return;
+	if (j->link) {
+		if (le->data) {
+			expand_name(le->data, le->len, j->escaped_filename, &j->out);
+		} else {
+			/* the first name could not be hashed, without workers to
+			 * queue this one to, see flush_jobs */
+			j->run(j);
+		}
+	}
+	if (!le->data && le->names_left > 1) le->data = strip_name(j, &le->len);
+	if (le->names_left && --le->names_left == 0) {
+		free(le->data);
+		le->data = NULL;
+	}
+}
+
+static void link_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < link_table.alloc_size; ++i) {
+		struct link_entry *le =
+			(struct link_entry *)(link_table.recs + i * link_table.rec_size);
+		if (link_table.used[i]) free(le->data);
+	}
+	htable_free(&link_table);
+}
+
+/* entries of a directory from the cache, as read by dir_list_read */
+static int cache_read_dir(const struct stat *st, struct dir_list *dl)
+{
+	struct cache_key key;
+	const char *data;
+	size_t len;
+
+	set_cache_key(&key, CACHE_DIR, st);
+	if (!(data = cache_get(&key, &len))) return -1;
+	if (len) {
+		if (!(dl->arena = (char *)malloc(len))) return -1;
+		memcpy(dl->arena, data, len);
+		dl->len = dl->size = len;
+	}
+	return dir_list_index(dl, 0);
+}
+
+/* store the entries in their sorted order */
+static void cache_store_dir(const struct stat *st, const struct dir_list *dl)
+{
+	struct cache_key key;
+	size_t i;
+	char *data, *dp;
+
+	if (!(data = (char *)malloc(dl->len ? dl->len : 1))) return;
+	for (dp = data, i = 0; i < dl->count; ++i) {
+		size_t name_len = strlen(dl->names[i]);
+		memcpy(dp, dl->names[i] - 1, 1 + name_len + 1);
+		dp += 1 + name_len + 1;
+	}
+	set_cache_key(&key, CACHE_DIR, st);
+	cache_put(&key, data, dl->len);
+}
+
+int do_xmd5_at(int dirfd, const char *name, const char *filename,
+               unsigned char d_type, struct trav_stat *ts);
+
+/* the entries of a directory read ahead by the traversal threads */
+static int do_xmd5_trav_dir(struct trav_dir *td, const char *filename,
+                            const char *escaped_filename, const struct stat *st)
+{
+	size_t name_off, i;
+	char *path;
+
+	if (trav_wait(td) != 0 || !(path = dir_path(filename, &td->dl, &name_off))) {
+		print_error_line("bad dir", strerror(errno), escaped_filename, trav_out());
+		trav_release(td);
+		return -1;
+	}
+	if (option_cache && !td->cached) cache_store_dir(st, &td->dl);
+	for (i = 0; i < td->dl.count; ++i) {
+		strcpy(path + name_off, td->dl.names[i]);
+		do_xmd5_at(AT_FDCWD, path, path, td->dl.names[i][-1], &td->stats[i]);
+	}
+	free(path);
+	trav_release(td);
+	return 0;
+}
+
+/* st is only needed with the cache, td is the task of the directory when
+ * it was found by the traversal threads */
+int do_xmd5_dir(int dirfd, const char *name, const char *filename,
+                const char *escaped_filename, const struct stat *st,
+                struct trav_dir *td)
+{
+	struct dir_list dl;
+	size_t name_off, i;
+	char *path;
+	int fd;
+
+	if (td || (td = trav_submit(filename, st))) {
+		return do_xmd5_trav_dir(td, filename, escaped_filename, st);
+	}
+	memset(&dl, 0, sizeof (dl));
+	if ((fd = open_dir_at(dirfd, name)) < 0) goto bad_dir_errno;
+	if (option_cache && cache_read_dir(st, &dl) == 0) goto read_done;
+	dir_list_free(&dl);
+	if (dir_list_read(fd, &dl, 1) != 0) goto bad_dir2_errno;
+	if (option_cache) cache_store_dir(st, &dl);
+
+read_done:
+	if (!(path = dir_path(filename, &dl, &name_off))) goto bad_dir2_errno;
+	fd = release_dir(fd);
+	for (i = 0; i < dl.count; ++i) {
+		strcpy(path + name_off, dl.names[i]);
+		do_xmd5_at(fd, fd == AT_FDCWD ? path : dl.names[i], path,
+		           dl.names[i][-1], NULL);
+	}
+	free(path);
+	dir_list_free(&dl);
+	close_dir(fd);
+
+	return 0;
+bad_dir2_errno:
+	print_error_line("bad dir", strerror(errno), escaped_filename, trav_out());
+	dir_list_free(&dl);
+	close_dir(fd);
+	return -1;
+bad_dir_errno:
+	print_error_line("bad dir", strerror(errno), escaped_filename, trav_out());
+	return -1;
+}
+
+/* with -i, the name field is preceded by a dev:ino field, or by - when
+ * the file could not be stat'ed; frees escaped_filename */
+static char *add_inode_field(char *escaped_filename, const char *filename,
+                             const struct stat *st)
+{
+	char *res = (char *)malloc(48 + strlen(escaped_filename));
+
+	if (res) {
+		if (st) {
+			sprintf(res, "%llu:%llu %s", (unsigned long long)st->st_dev,
+			        (unsigned long long)st->st_ino, escaped_filename);
+		} else {
+			sprintf(res, "- %s", escaped_filename);
+		}
+	}
+	if (escaped_filename != filename) free(escaped_filename);
+	return res;
+}
+
+/* Checkpoints (-C) of long scans. The output slots carry the last entry
+ * of the traversal they hold the output of, and every CHECKPOINT_INTERVAL
+ * seconds the last one written is saved with the size of the output. A
+ * run with the same paths and output options (-H, -n, -A, -r, -i, -B, -s
+ * and -p), appending to the same output, truncates
+ * it to that size and skips the entries up to that one in the sorted
+ * order of the traversal. The -s and -p passes are done again, so that
+ * the output is the same as without the interruption.
+ *
+ * file: magic, hash of the arguments, argument index, output size, then
+ * the length and bytes of the entry and of the last path of -B. The
+ * first checkpoint, with no entry, is saved at the start, so that the
+ * output of a run killed before the second one is dropped too. */
+static unsigned cur_arg = 0;
+static char *ckpt_pos = NULL;
+static unsigned ckpt_arg = 0;
+static int ckpt_dirty = 0;
+static time_t ckpt_time = 0;
+static unsigned long long ckpt_args = 0;
+/* position loaded from the checkpoint, until the traversal is past it */
+static char *resume_pos = NULL;
+static unsigned resume_arg = 0;
+
+/* the options that change the output and the paths, the others such as
+ * the threads or the throttling can change when a scan is resumed */
+static unsigned long long args_hash(int argc, char **argv)
+{
+	unsigned options[8];
+	unsigned long long h;
+	int i;
+
+	options[0] = option_hash;
+	options[1] = option_archives;
+	options[2] = option_all_archives;
+	options[3] = option_nest_depth;
+	options[4] = option_inode;
+	options[5] = option_binary;
+	options[6] = option_size_filter;
+	options[7] = option_partial;
+	h = XXH64(options, sizeof (options), 0);
+	for (i = optind; i < argc; ++i) h = XXH64(argv[i], strlen(argv[i]) + 1, h);
+	return h;
+}
+
+static int checkpoint_save(void)
+{
+	struct stat st;
+	char *tmp_filename;
+	FILE *f;
+	const char *list_path = option_binary ? out_list.path : NULL;
+	size_t list_path_len = option_binary ? out_list.path_len : 0;
+	int ret = 0;
+
+	/* the output must be on disk before the checkpoint is */
+	if (fflush(stdout) != 0 || fsync(STDOUT_FILENO) != 0 ||
+	    fstat(STDOUT_FILENO, &st) != 0) return -1;
+	if (ckpt_pos && option_cache && cache_save(option_cache, 1) != 0) return -1;
+	if (!(tmp_filename = (char *)malloc(strlen(option_checkpoint) + 5))) return -1;
+	sprintf(tmp_filename, "%s.tmp", option_checkpoint);
+	if (!(f = fopen(tmp_filename, "wb"))) {
+		free(tmp_filename);
+		return -1;
+	}
+	fprintf(f, "%s%016llx\n%u\n%llu\n%zu\n", CHECKPOINT_MAGIC, ckpt_args, ckpt_arg,
+	        (unsigned long long)st.st_size, ckpt_pos ? strlen(ckpt_pos) : 0);
+	if (ckpt_pos) fwrite(ckpt_pos, 1, strlen(ckpt_pos), f);
+	fprintf(f, "\n%zu\n", list_path_len);
+	if (list_path_len) fwrite(list_path, 1, list_path_len, f);
+	putc('\n', f);
+	if (ferror(f) || fflush(f) != 0 || fsync(fileno(f)) != 0) ret = -1;
+	if (fclose(f) != 0) ret = -1;
+	if (ret == 0 && rename(tmp_filename, option_checkpoint) != 0) ret = -1;
+	if (ret != 0) unlink(tmp_filename);
+	free(tmp_filename);
+	return ret;
+}
+
+/* j was just written out */
+static void checkpoint_flushed(struct job *j)
+{
+	time_t now;
+
+	if (j->pos) {
+		free(ckpt_pos);
+		ckpt_pos = j->pos;
+		ckpt_arg = j->pos_arg;
+		j->pos = NULL;
+		ckpt_dirty = 1;
+	}
+	if (!ckpt_dirty || (now = time(NULL)) - ckpt_time < CHECKPOINT_INTERVAL) return;
+	if (checkpoint_save() != 0) perror(option_checkpoint);
+	ckpt_time = now;
+	ckpt_dirty = 0;
+}
+
+/* the traversal is done with filename, after the output slots so far */
+static void checkpoint_pos(const char *filename)
+{
+	char *pos = strdup(filename);
+
+	if (!pos) return;
+	pthread_mutex_lock(&job_mutex);
+	if (out_tail) {
+		free(out_tail->pos);
+		out_tail->pos = pos;
+		out_tail->pos_arg = cur_arg;
+		pos = NULL;
+	}
+	pthread_mutex_unlock(&job_mutex);
+	if (pos) {
+		struct job j;
+		memset(&j, 0, sizeof (j));
+		j.pos = pos;
+		j.pos_arg = cur_arg;
+		checkpoint_flushed(&j);
+	}
+}
+
+static char *read_counted(FILE *f, size_t *len)
+{
+	char *s;
+
+	if (fscanf(f, "%zu", len) != 1 || getc(f) != '\n' ||
+	    !(s = (char *)malloc(*len + 1))) return NULL;
+	if (fread(s, 1, *len, f) != *len || getc(f) != '\n') {
+		free(s);
+		return NULL;
+	}
+	s[*len] = '\0';
+	return s;
+}
+
+/* 1 when the run resumes from the checkpoint, 0 when there is none */
+static int checkpoint_load(void)
+{
+	char magic[sizeof (CHECKPOINT_MAGIC)];
+	unsigned long long args, size;
+	char *list_path = NULL;
+	size_t len, list_path_len;
+	FILE *f = fopen(option_checkpoint, "rb");
+
+	if (!f) return errno == ENOENT ? 0 : -1;
+	errno = EINVAL;
+	if (fread(magic, 1, strlen(CHECKPOINT_MAGIC), f) != strlen(CHECKPOINT_MAGIC) ||
+	    memcmp(magic, CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC)) != 0 ||
+	    fscanf(f, "%llx\n%u\n%llu\n", &args, &resume_arg, &size) != 3 ||
+	    !(resume_pos = read_counted(f, &len)) ||
+	    !(list_path = read_counted(f, &list_path_len))) goto error;
+	if (args != ckpt_args) {
+		fprintf(stderr, "%s: checkpoint of a run with other paths or output options\n", option_checkpoint);
+		exit(EXIT_FAILURE);
+	}
+	if (lseek(STDOUT_FILENO, 0, SEEK_END) < (off_t)size) {
+		fprintf(stderr, "%s: the output is shorter than at the checkpoint, append to it with >>\n",
+		        option_checkpoint);
+		exit(EXIT_FAILURE);
+	}
+	if (ftruncate(STDOUT_FILENO, size) != 0 || lseek(STDOUT_FILENO, size, SEEK_SET) < 0) goto error;
+	if (option_binary &&
+	    xlist_write_resume(&out_list, stdout, hash_algos[option_hash].tag,
+	                       hash_algos[option_hash].digest_length, option_inode,
+	                       list_path, list_path_len) != 0) goto error;
+	free(list_path);
+	fclose(f);
+	if (!len) {
+		free(resume_pos);
+		resume_pos = NULL;
+	} else {
+		ckpt_pos = strdup(resume_pos);
+		ckpt_arg = resume_arg;
+	}
+	return 1;
+error:
+	free(list_path);
+	free(resume_pos);
+	resume_pos = NULL;
+	fclose(f);
+	return -1;
+}
+
+/* whether filename is an entry up to the checkpoint, whose output is
+ * already there. Only the entries of the directories leading to the
+ * checkpoint are asked, until the first one past it. */
+static int resume_skip(const char *filename)
+{
+	size_t len = strlen(filename), off, pos_len;
+	int cmp;
+
+	if (!resume_pos || cur_arg < resume_arg) return resume_pos != NULL;
+	if (cur_arg == resume_arg) {
+		if (strcmp(filename, resume_pos) == 0) {
+			/* the checkpoint itself, the traversal is past it */
+			free(resume_pos);
+			resume_pos = NULL;
+			return 1;
+		}
+		/* a directory leading to it */
+		if (strncmp(filename, resume_pos, len) == 0 && resume_pos[len] == '/') return 0;
+		/* an entry of such a directory, compared with the one leading
+		 * to the checkpoint */
+		off = strrchr(filename, '/') ? strrchr(filename, '/') - filename + 1 : 0;
+		if (off && strncmp(filename, resume_pos, off) == 0) {
+			pos_len = strcspn(resume_pos + off, "/");
+			cmp = strncmp(filename + off, resume_pos + off, pos_len);
+			if (cmp < 0) return 1;
+		}
+	}
+	free(resume_pos);
+	resume_pos = NULL;
+	return 0;
+}
+
+/* the entry name of the directory dirfd, of type d_type when known, and
+ * with the path filename; ts is what the traversal threads found of it */
+static int do_xmd5_entry(int dirfd, const char *name, const char *filename,
+                         unsigned char d_type, struct trav_stat *ts)
+{
+	struct stat st;
+	char *escaped_filename = escape_filename(filename);
+	int stat_errno = 0;
+	int phase;
+	int ret = -1;
+
+	stats_add(&stats->entries, 1);
+	if (!escaped_filename) {
+		print_error_line("escape name fail", strerror(errno), "???", trav_out());
+		return -1;
+	}
+
+	if (ts && ts->stat_errno >= 0) {
+		st = ts->st;
+		stat_errno = ts->stat_errno;
+	} else if (!needs_stat(d_type)) {
+		memset(&st, 0, sizeof (st));
+		st.st_mode = DTTOIF(d_type);
+	} else {
+		phase = stats_phase(PHASE_STAT);
+		if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) stat_errno = errno;
+		stats_phase(phase);
+	}
+	if (stat_errno) {
+		if (option_inode) escaped_filename = add_inode_field(escaped_filename, filename, NULL);
+		print_error_line("stat fail", strerror(stat_errno),
+		                 escaped_filename ? escaped_filename : "- ???", trav_out());
+		if (filename != escaped_filename) free(escaped_filename);
+		return -1;
+	}
+	if (option_inode &&
+	    !(escaped_filename = add_inode_field(escaped_filename, filename, &st))) {
+		print_error_line("escape name fail", strerror(errno), "- ???", trav_out());
+		return -1;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		const char *unread_reason = get_unread_reason(&st);
+		if (unread_reason) {
+			print_unread_line(unread_reason, st.st_size,
+			                  escaped_filename, trav_out());
+			ret = 0;
+		} else if (option_cache &&
+		           cache_output_file(&st, escaped_filename, trav_out()) == 0) {
+			stats_add(&stats->done_files, 1);
+			stats_add(&stats->done_bytes, st.st_size);
+			ret = 0;
+		} else {
+			ret = submit_file(filename, escaped_filename, &st, run_hash_job);
+		}
+	} else if (S_ISDIR(st.st_mode)) {
+		ret = do_xmd5_dir(dirfd, name, filename, escaped_filename, &st,
+		                  trav_take_dir(ts));
+	} else if (S_ISLNK(st.st_mode)) {
+		print_error_line("file type", "link", escaped_filename, trav_out());
+		ret = -1;
+	} else if (S_ISCHR(st.st_mode)) {
+		print_error_line("file type", "char device", escaped_filename, trav_out());
+		ret = -1;
+	} else if (S_ISBLK(st.st_mode)) {
+		print_error_line("file type", "block device", escaped_filename, trav_out());
+		ret = -1;
+	} else if (S_ISFIFO(st.st_mode)) {
+		print_error_line("file type", "fifo", escaped_filename, trav_out());
+		ret = -1;
+	} else if (S_ISSOCK(st.st_mode)) {
+		print_error_line("file type", "socket", escaped_filename, trav_out());
+		ret = -1;
+	} else {
+		print_error_line("file type", "unknown", escaped_filename, trav_out());
+		ret = -1;
+	}
+
+	if (filename != escaped_filename) free(escaped_filename);
+	return ret;
+}
+
+int do_xmd5_at(int dirfd, const char *name, const char *filename,
+               unsigned char d_type, struct trav_stat *ts)
+{
+	int ret;
+
+	if (resume_skip(filename)) return 0;
+	ret = do_xmd5_entry(dirfd, name, filename, d_type, ts);
+	if (option_checkpoint) checkpoint_pos(filename);
+	return ret;
+}
+
+int do_xmd5(const char *filename)
+{
+	return do_xmd5_at(AT_FDCWD, filename, filename, DT_UNKNOWN, NULL);
+}
+
+/* Progress reports, written by their own thread every -S seconds, and
+ * whenever SIGUSR1 is received, to stderr or to the -T status file. The
+ * signal is blocked in every other thread, the sandboxes included. */
+static const char *phase_names[PHASE_COUNT] = { NULL, "stat", "read", "hash", "archive" };
+static pthread_t stats_thread;
+static int stats_end = 0;
+static unsigned long long stats_start_ns = 0;
+/* the start of the hashing pass, for the estimate of -E */
+static unsigned long long hash_start_ns = 0;
+static struct stats stats_last;
+static unsigned long long stats_last_ns = 0;
+
+static const char *format_size(char *buf, unsigned long long size)
+{
+	static const char units[] = "KMGTPE";
+	double v = size;
+	int i;
+
+	if (size < 1024) {
+		sprintf(buf, "%llu", size);
+		return buf;
+	}
+	for (i = 0; v >= 1024 && units[i]; ++i) v /= 1024;
+	sprintf(buf, "%.1f%c", v, units[i - 1]);
+	return buf;
+}
+
+static const char *format_duration(char *buf, unsigned long long seconds)
+{
+	sprintf(buf, "%llu:%02llu:%02llu", seconds / 3600, seconds / 60 % 60, seconds % 60);
+	return buf;
+}
+
+static void stats_report(struct xbuf *b)
+{
+	struct stats cur;
+	const struct job *j;
+	unsigned long long now = now_ns();
+	unsigned long long dt, start, busy = 0, started = 0;
+	size_t work_count, archive_count, pending, ahead;
+	char *oldest = NULL;
+	char s1[32], s2[32], s3[32];
+	int i;
+
+	memcpy(&cur, stats, sizeof (cur));
+	pthread_mutex_lock(&job_mutex);
+	work_count = work_queue.count;
+	archive_count = archive_queue.count;
+	pending = out_count;
+	for (j = out_head; j; j = j->next) {
+		if (j->done || !j->escaped_filename) continue;
+		started = __atomic_load_n(&j->started, __ATOMIC_RELAXED);
+		oldest = strdup(j->escaped_filename);
+		break;
+	}
+	pthread_mutex_unlock(&job_mutex);
+	pthread_mutex_lock(&trav_mutex);
+	ahead = trav_ahead;
+	pthread_mutex_unlock(&trav_mutex);
+
+	xbuf_printf(b, "elapsed %s: %llu entries, %llu files %s read, %llu members %s listed\n",
+	            format_duration(s1, (now - stats_start_ns) / 1000000000ull),
+	            cur.entries, cur.files, format_size(s2, cur.bytes),
+	            cur.members, format_size(s3, cur.member_bytes));
+	dt = now - stats_last_ns;
+	if (!dt) dt = 1;
+	xbuf_printf(b, "rate: %.0f files/s, %s/s read, %s/s listed\n",
+	            (cur.files - stats_last.files) * 1e9 / dt,
+	            format_size(s1, (cur.bytes - stats_last.bytes) * 1000000000ull / dt),
+	            format_size(s2, (cur.member_bytes - stats_last.member_bytes) * 1000000000ull / dt));
+	xbuf_printf(b, "queues: work %zu, archive %zu, output %zu, traversal %zu\n",
+	            work_count, archive_count, pending, ahead);
+	for (i = PHASE_NONE + 1; i < PHASE_COUNT; ++i) {
+		busy += cur.phase_ns[i] - stats_last.phase_ns[i];
+	}
+	xbuf_printf(b, "time:");
+	for (i = PHASE_NONE + 1; i < PHASE_COUNT; ++i) {
+		xbuf_printf(b, "%s %s %.0f%%", i == PHASE_NONE + 1 ? "" : ",", phase_names[i],
+		            busy ? (cur.phase_ns[i] - stats_last.phase_ns[i]) * 100.0 / busy : 0.0);
+	}
+	xbuf_printf(b, "\n");
+	if (option_totals) {
+		xbuf_printf(b, "progress: %llu of %llu files, %s of %s",
+		            cur.done_files, cur.total_files, format_size(s1, cur.done_bytes),
+		            format_size(s2, cur.total_bytes));
+		start = __atomic_load_n(&hash_start_ns, __ATOMIC_RELAXED);
+		if (start && cur.done_files && (cur.total_files > cur.done_files ||
+		                                cur.total_bytes > cur.done_bytes)) {
+			/* the slower of the estimates from the files and the bytes */
+			double left = (double)cur.total_files / cur.done_files - 1;
+
+			if (cur.done_bytes && (double)cur.total_bytes / cur.done_bytes - 1 > left) {
+				left = (double)cur.total_bytes / cur.done_bytes - 1;
+			}
+			if (left < 0) left = 0;
+			xbuf_printf(b, ", %.1f%%, eta %s", 100 / (1 + left),
+			            format_duration(s1, left * (now - start) / 1e9));
+		}
+		xbuf_printf(b, "\n");
+	}
+	if (oldest) {
+		xbuf_printf(b, "oldest: %s (%llu s)\n", oldest,
+		            started ? (now - started) / 1000000000ull : 0);
+		free(oldest);
+	}
+	stats_last = cur;
+	stats_last_ns = now;
+}
+
+static void stats_write(void)
+{
+	struct xbuf b = { NULL, 0, 0 };
+	char *tmp_filename;
+	FILE *f;
+	int ret = 0;
+
+	stats_report(&b);
+	if (!b.len) goto end;
+	if (!option_status) {
+		fwrite(b.data, 1, b.len, stderr);
+		goto end;
+	}
+	/* readers never see a partial report */
+	if (!(tmp_filename = (char *)malloc(strlen(option_status) + 5))) goto error;
+	sprintf(tmp_filename, "%s.tmp", option_status);
+	if (!(f = fopen(tmp_filename, "w"))) {
+		free(tmp_filename);
+		goto error;
+	}
+	fwrite(b.data, 1, b.len, f);
+	if (ferror(f)) ret = -1;
+	if (fclose(f) != 0) ret = -1;
+	if (ret == 0 && rename(tmp_filename, option_status) != 0) ret = -1;
+	if (ret != 0) unlink(tmp_filename);
+	free(tmp_filename);
+	if (ret != 0) goto error;
+end:
+	xbuf_free(&b);
+	return;
+error:
+	perror(option_status);
+	xbuf_free(&b);
+}
+
+static void *stats_main(void *arg)
+{
+	sigset_t set;
+	struct timespec ts;
+	int sig;
+
+	(void)arg;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	for (;;) {
+		ts.tv_sec = option_stats_interval;
+		ts.tv_nsec = 0;
+		sig = option_stats_interval ? sigtimedwait(&set, NULL, &ts) : sigwaitinfo(&set, NULL);
+		if (sig < 0 && errno == EINTR) continue;
+		if (__atomic_load_n(&stats_end, __ATOMIC_ACQUIRE)) break;
+		stats_write();
+	}
+	return NULL;
+}
+
+/* before any other thread is created */
+static void stats_start(void)
+{
+	sigset_t set;
+
+	stats_init();
+	stats_start_ns = stats_last_ns = now_ns();
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0 ||
+	    pthread_create(&stats_thread, NULL, stats_main, NULL) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* with -S or -T, a last report */
+static void stats_stop(void)
+{
+	__atomic_store_n(&stats_end, 1, __ATOMIC_RELEASE);
+	pthread_kill(stats_thread, SIGUSR1);
+	pthread_join(stats_thread, NULL);
+	if (option_stats_interval) stats_write();
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned long long bytes;
+	int opt;
+	int resumed = 0;
+	int i;
+
+	while ((opt = getopt(argc, argv, "hj:t:x:r:spc:H:nAub:Nmo:iaBR:F:L:P:C:S:T:EkM:")) != -1) {
+		switch (opt) {
+		case 'j':
+			option_jobs = parse_count(opt, optarg, 1, MAX_THREADS);
+			break;
+		case 't':
+			option_trav_threads = parse_count(opt, optarg, 0, MAX_THREADS);
+			break;
+		case 'x':
+			option_archive_jobs = parse_count(opt, optarg, 1, MAX_THREADS);
+			break;
+		case 'r':
+			option_nest_depth = parse_count(opt, optarg, 0, ~0u);
+			break;
+		case 's':
+			option_size_filter = 1;
+			break;
+		case 'p':
+			option_size_filter = 1;
+			option_partial = 1;
+			break;
+		case 'c':
+			option_cache = optarg;
+			break;
+		case 'n':
+			option_archives = 0;
+			break;
+		case 'A':
+			option_all_archives = 1;
+			break;
+		case 'u':
+			option_uring = 1;
+			break;
+		case 'b':
+			if (!(bytes = parse_rate(optarg)) || bytes > MAX_READ_SIZE) {
+				fprintf(stderr, "%s: invalid read size (bytes up to 1g, with an optional k, m or g suffix)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			option_read_size = bytes;
+			if (option_read_size < 4096) option_read_size = 4096;
+			option_read_size = (option_read_size + 4095) & ~(size_t)4095;
+			break;
+		case 'N':
+			option_noreuse = 1;
+			break;
+		case 'm':
+			option_mmap = 1;
+			break;
+		case 'i':
+			option_inode = 1;
+			break;
+		case 'a':
+			option_list_cache = 1;
+			break;
+		case 'B':
+			option_binary = 1;
+			break;
+		case 'o':
+			option_disk_order = 1;
+			option_order_batch = parse_count(opt, optarg, 0, ~0u);
+			break;
+		case 'C':
+			option_checkpoint = optarg;
+			break;
+		case 'S':
+			option_stats_interval = parse_count(opt, optarg, 0, ~0u);
+			if (!option_stats_interval) option_stats_interval = 1;
+			break;
+		case 'T':
+			option_status = optarg;
+			break;
+		case 'E':
+			option_totals = 1;
+			break;
+		case 'k':
+			option_kernel_hash = 1;
+			break;
+		case 'M':
+			if (!(option_sort_memory = parse_rate(optarg))) {
+				fprintf(stderr, "%s: invalid sort memory (bytes, with an optional k, m or g suffix)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'R':
+			if (!(option_rate = parse_rate(optarg))) {
+				fprintf(stderr, "%s: invalid rate (bytes/s, with an optional k, m or g suffix)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'F':
+			option_file_rate = parse_count(opt, optarg, 1, ~0ull);
+			break;
+		case 'L':
+			option_latency = parse_count(opt, optarg, 1, ~0ull / 1000000) * 1000000ull;
+			break;
+		case 'P':
+			if (!(option_ioprio = parse_ioprio(optarg))) {
+				fprintf(stderr, "%s: unknown I/O priority (idle, be, be:0 to be:7)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'H':
+			for (option_hash = 0; hash_algos[option_hash].name; ++option_hash) {
+				if (strcmp(optarg, hash_algos[option_hash].name) == 0) break;
+			}
+			if (!hash_algos[option_hash].name) {
+				fprintf(stderr, "%s: unknown hash (md5, xxh128)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'h':
+		default:
+			fprintf(stderr, "Usage: %s [-spnAuNmiaBEk] [-j threads] [-t threads] [-x threads] [-r depth] [-c cache] [-H hash] [-b read_size] [-o batch] [-R bytes/s] [-F files/s] [-L ms] [-P ioprio] [-C checkpoint] [-M sort_memory] [-S seconds] [-T status_file] file...\n", argv[0]);
+			fprintf(stderr, "  -s  only hash the files sharing their size with another file; the sizes of\n"
+			                "      archive members are not known then, so a file whose only duplicate is\n"
+			                "      an archive member, or a member of an archive of a unique size, is missed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+#ifdef DO_MTRACE
+	mtrace();
+#endif
+	if (option_status && !option_stats_interval) option_stats_interval = STATS_INTERVAL;
+	if (option_list_cache && !option_cache) {
+		/* the listings are kept in the cache file, across runs */
+		fprintf(stderr, "-a: needs a cache file, given with -c\n");
+		exit(EXIT_FAILURE);
+	}
+	if (option_kernel_hash && !hash_algos[option_hash].alg) {
+		fprintf(stderr, "%s: no kernel hash, using the read path\n", hash_algos[option_hash].name);
+		option_kernel_hash = 0;
+	}
+	if (option_uring && option_latency) {
+		/* its queued reads are always slower than the target */
+		fprintf(stderr, "-L: no latency backoff for the io_uring reads, only for the archives they hand over\n");
+	}
+	if (option_kernel_hash) {
+		/* once for all the threads and sandboxes */
+		int fd = alg_open();
+		if (fd >= 0) close(fd);
+	}
+	stats_start();
+	if (option_mmap) signal(SIGBUS, mmap_sigbus);
+	/* before any thread or sandbox, which inherit it */
+	if (option_ioprio &&
+	    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, option_ioprio) != 0) {
+		perror("ioprio_set");
+	}
+	throttle_init();
+	if (option_checkpoint) {
+		struct stat st;
+		if (fstat(STDOUT_FILENO, &st) != 0 || !S_ISREG(st.st_mode)) {
+			fprintf(stderr, "%s: the output must be a regular file\n", option_checkpoint);
+			exit(EXIT_FAILURE);
+		}
+		ckpt_args = args_hash(argc, argv);
+		ckpt_time = time(NULL);
+		if ((resumed = checkpoint_load()) < 0) {
+			perror(option_checkpoint);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (option_binary && !resumed &&
+	    xlist_write_open(&out_list, stdout, hash_algos[option_hash].tag,
+	                     hash_algos[option_hash].digest_length, option_inode) != 0) {
+		perror("stdout");
+		exit(EXIT_FAILURE);
+	}
+	if (option_checkpoint && !resumed && checkpoint_save() != 0) {
+		perror(option_checkpoint);
+		exit(EXIT_FAILURE);
+	}
+	if (option_cache && cache_load(option_cache) != 0) {
+		fprintf(stderr, "%s: cannot load cache, starting a new one\n", option_cache);
+		cache_free();
+	}
+	if (resumed) cache_see_all();
+	trav_start();
+	if (option_size_filter) {
+		for (i = optind; i < argc; ++i) walk_files(argv[i], count_size_file);
+	}
+	if (option_totals) {
+		for (i = optind; i < argc; ++i) walk_files(argv[i], count_total_file);
+	}
+	start_workers();
+	if (option_partial) {
+		for (i = optind; i < argc; ++i) walk_files(argv[i], submit_partial_file);
+		flush_jobs(1);
+	}
+	__atomic_store_n(&hash_start_ns, now_ns(), __ATOMIC_RELAXED);
+	for (i = optind; i < argc; ++i) {
+		cur_arg = i - optind;
+		do_xmd5(argv[i]);
+	}
+	stop_workers();
+	trav_stop();
+	stats_stop();
+	if (option_binary) xlist_close(&out_list);
+	if (option_cache && cache_save(option_cache, 0) != 0) perror(option_cache);
+	/* the scan is complete */
+	if (option_checkpoint && fflush(stdout) == 0 && unlink(option_checkpoint) != 0 &&
+	    errno != ENOENT) {
+		perror(option_checkpoint);
 	}
+	free(ckpt_pos);
+	cache_free();
+	htable_free(&size_table);
+	htable_free(&partial_inode_table);
+	htable_free(&partial_count_table);
+	link_free();
 #ifdef DO_MTRACE
 	muntrace();
 #endif
@@ -0,0 +1,188 @@
+/* Convert xmd5 listings between the text and the -B binary format */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xlist.h"
+
+int option_inode = 0;
+int option_text = 0;
+
+static int is_hex(const char *p, const char *end)
+{
+	for (; p < end; ++p) {
+		if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f') ||
+		      (*p >= 'A' && *p <= 'F'))) return 0;
+	}
+	return 1;
+}
+
+/* tag and digest length of a digest field, 0 if it does not look like one */
+static size_t get_digest_length(const char *line, size_t len, char *tag)
+{
+	const char *end = memchr(line, ' ', len);
+	const char *colon;
+	size_t tag_len;
+
+	if (!end) return 0;
+	colon = memchr(line, ':', end - line);
+	tag_len = colon ? (size_t)(colon + 1 - line) : 0;
+	if (tag_len > XLIST_MAX_TAG) return 0;
+	if ((end - line - tag_len) % 2 != 0 || end - line - tag_len == 0 ||
+	    (end - line - tag_len) / 2 > XLIST_MAX_DIGEST ||
+	    !is_hex(line + tag_len, end)) return 0;
+	memcpy(tag, line, tag_len);
+	tag[tag_len] = '\0';
+	return (end - line - tag_len) / 2;
+}
+
+/* held holds NUL terminated lines */
+static int write_held(struct xlist *x, const char *held, size_t held_len,
+                      const char *filename, size_t *line_nb)
+{
+	const char *p;
+	int ret = 0;
+
+	for (p = held; p < held + held_len; p += strlen(p) + 1) {
+		++*line_nb;
+		if (*p && xlist_write_line(x, p, strlen(p)) != 0) {
+			fprintf(stderr, "%s:%zu: cannot convert line\n", filename, *line_nb);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static int to_binary(FILE *in, const char *filename)
+{
+	struct xlist x;
+	char *line = NULL;
+	size_t alloc = 0;
+	ssize_t len;
+	size_t line_nb = 0;
+	char *held = NULL;
+	size_t held_len = 0;
+	int opened = 0;
+	int ret = 0;
+	char tag[XLIST_MAX_TAG + 1];
+	size_t digest_length;
+
+	while ((len = getline(&line, &alloc, in)) >= 0) {
+		if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+		if (!opened) {
+			/* lines before the first digest wait for the header */
+			digest_length = get_digest_length(line, len, tag);
+			if (!digest_length) {
+				char *p = realloc(held, held_len + len + 1);
+				if (!p) goto error_mem;
+				held = p;
+				memcpy(held + held_len, line, len + 1);
+				held_len += len + 1;
+				continue;
+			}
+			if (xlist_write_open(&x, stdout, tag, digest_length, option_inode) != 0)
+				goto error_write;
+			opened = 1;
+			if (write_held(&x, held, held_len, filename, &line_nb) != 0) ret = -1;
+		}
+		++line_nb;
+		if (len > 0 && xlist_write_line(&x, line, len) != 0) {
+			fprintf(stderr, "%s:%zu: cannot convert line\n", filename, line_nb);
+			ret = -1;
+		}
+	}
+	if (!opened) {
+		/* no digest at all, md5 is the default */
+		if (xlist_write_open(&x, stdout, "", 16, option_inode) != 0) goto error_write;
+		if (write_held(&x, held, held_len, filename, &line_nb) != 0) ret = -1;
+	}
+	free(held);
+	free(line);
+	xlist_close(&x);
+	return ret;
+
+error_mem:
+	perror(filename);
+	free(held);
+	free(line);
+	return -1;
+error_write:
+	perror("stdout");
+	free(held);
+	free(line);
+	return -1;
+}
+
+static int to_text(FILE *in, const char *filename)
+{
+	struct xlist x;
+	struct xlist_entry e;
+	int ret;
+
+	if (xlist_read_open(&x, in, NULL, 0) != 0) {
+		fprintf(stderr, "%s: bad header\n", filename);
+		xlist_close(&x);
+		return -1;
+	}
+	while ((ret = xlist_read(&x, &e)) > 0) {
+		char *line = xlist_format_line(&x, &e);
+		if (!line) {
+			perror(filename);
+			ret = -1;
+			break;
+		}
+		fputs(line, stdout);
+		free(line);
+	}
+	if (ret < 0) fprintf(stderr, "%s: truncated listing\n", filename);
+	xlist_close(&x);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-it] [file]\n", name);
+	fprintf(stderr, "  -i  text listing has inode fields (xmd5 -i)\n");
+	fprintf(stderr, "  -t  convert a binary listing back to text\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in = stdin;
+	const char *filename = "stdin";
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "it")) != -1) {
+		switch (opt) {
+		case 'i':
+			option_inode = 1;
+			break;
+		case 't':
+			option_text = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind > 1) usage(argv[0]);
+	if (optind < argc) {
+		filename = argv[optind];
+		in = fopen(filename, "r");
+		if (!in) {
+			perror(filename);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	ret = option_text ? to_text(in, filename) : to_binary(in, filename);
+	if (in != stdin) fclose(in);
+	if (fflush(stdout) != 0) {
+		perror("stdout");
+		ret = -1;
+	}
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}